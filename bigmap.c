@@ -200,8 +200,9 @@ size_t bigmap_check(struct bigmap *map)
 		for (unsigned i = 0; i < maps; i++) {
 			trace_off("check %u level %u", i, level);
 			unsigned wrap = bigmap_wrap(map, stridebits, i);
+			loc_t maploc = ith_to_maploc(level, blockbits, stridebits, i);
 			trace_off("load map %u wrap %u", maploc, wrap);
-			struct datamap parent = {.data = ext_bigmap_mem(map, i), .loc = i};
+			struct datamap parent = {.data = ext_bigmap_mem(map, maploc), .loc = maploc};
 
 			for (unsigned j = 0; j < wrap; j++) {
 				unsigned child_ith = (i << blockbits) + j;
@@ -390,6 +391,7 @@ int bigmap_try(struct bigmap *map, unsigned len, unsigned big)
 
 		while (1) {
 			unsigned bound = p->map.data[p->at];
+			map->scanned++;
 			assert(p == map->path + level && stridebits == level * blockbits);
 			trace("scan %u:%u[%u] = %u, wrap %u, big %u", level, p->map.loc, p->at, bound, p->wrap, p->big);
 
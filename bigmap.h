@@ -18,6 +18,7 @@ struct bigmap
 	uint8_t big;
 	uint16_t reclen; // this is only here because some ext_bigmap functions need it. Fix!!!
 	uint8_t *rbspace; // this is only here because we have not properly abstracted the block mapping yet!!!
+	uint64_t scanned; // map entries examined by bigmap_try, for stats
 };
 
 /* Exports */
@@ -6,6 +6,7 @@
 
 extern "C" {
 #include <stdio.h>
+#include <stddef.h> // offsetof
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -15,6 +16,7 @@ extern "C" {
 #include "shardmap.h"
 
 #include <type_traits> // is_pod
+#include <string>
 extern "C" {
 #include <sys/ioctl.h> // terminal size awareness in help/usage
 #include "options.h"
@@ -25,6 +27,48 @@ int uform(char *buf, int len, unsigned long n, unsigned base);
 
 #define trace trace_off
 
+/* Ycsb style workload benchmark, see bench_run */
+
+enum bench_dist {dist_uniform, dist_zipfian, dist_latest};
+
+struct benchspec
+{
+	char workload = 'a';
+	unsigned records = 100000, ops = 1000000, warmup = 100000, threads = 1;
+	int distribution = -1; // per workload
+	unsigned keysize = 16, valuesize = 100, scanmax = 100;
+	unsigned cores = 0, depth = 1; // shared nothing workers and requests in flight per client
+	unsigned logorder = logorder_default, loglanes = 1;
+	unsigned cache = 0; // shard cache budget per table in KiB, zero for no limit
+	bool json = 0, timing = 0;
+};
+
+/* Tpc-b style benchmark, see tpcb_run */
+
+struct tpcbspec
+{
+	unsigned scale = 2, steps = 1000000, threads = 1, remote = 15, duration = 0;
+	unsigned pool = 0, logorder = logorder_default, loglanes = 1;
+	unsigned cache = 0; // shard cache budget per table in KiB, zero for no limit
+	unsigned workers = 0; // maintenance pool threads, zero for one per cpu
+	bool bulk = 0, direct = 0;
+};
+
+int tpcb_run(const char *path, const struct tpcbspec &spec);
+
+int bench_distribution(const char *name);
+int bench_run(const char *path, const struct benchspec &spec);
+int inspect_run(const char *path, unsigned threads, bool json, bool verbose);
+
+/* Persistent memory emulation totals, load and run together */
+static void emulation_report()
+{
+	if (pmconfig.backend == pm_emulate)
+		printf("emulated pmem %u ns %u MB/s: %lu lines flushed, %lu bytes streamed, %lu fences, %.3f seconds stalled\n",
+			pmconfig.latency_ns, pmconfig.bandwidth_mbs, pmstats.lines, pmstats.streamed, pmstats.fences,
+			pmstats.stall_ns / 1e9);
+}
+
 void usage(struct option *options, const char *name, const char *blurb)
 {
 	const char *usage = "";
@@ -53,6 +97,17 @@ int main(int argc, const char *argv[])
 		struct option options[] = {
 			{"scale", "s", OPT_HASARG|OPT_NUMBER, "Scale factor", "2"},
 			{"nsteps", "n", OPT_HASARG|OPT_NUMBER, "Transaction steps", "1000000"},
+			{"bulk", "b", 0, "Bulk load accounts"},
+			{"durability", "d", OPT_HASARG, "Durability backend (volatile, pmem, pagecache, emulate[:ns[:MB/s]])", "volatile"},
+			{"pool", "p", OPT_HASARG|OPT_NUMBER, "Accounts record block pool frames, 0 to map", "0"},
+			{"direct", "o", 0, "Block pool io bypasses page cache"},
+			{"logorder", "l", OPT_HASARG|OPT_NUMBER, "Microlog entries per lane as power of 2, unify batch is half", "9"},
+			{"loglanes", "L", OPT_HASARG|OPT_NUMBER, "Microlog lanes, each thread commits to one", "1"},
+			{"cache", "m", OPT_HASARG|OPT_NUMBER, "Shard cache KiB per table, evicting clean shards beyond it, 0 for no limit", "0"},
+			{"threads", "t", OPT_HASARG|OPT_NUMBER, "Client threads, each with its own share of branches", "1"},
+			{"workers", "w", OPT_HASARG|OPT_NUMBER, "Maintenance pool threads for unify and reshard, 0 for one per cpu", "0"},
+			{"remote", "r", OPT_HASARG|OPT_NUMBER, "Percent of transactions on an account at another branch", "15"},
+			{"duration", "D", OPT_HASARG|OPT_NUMBER, "Run for this many seconds instead of a number of steps"},
 			{"version", "V", 0, "Show version"},
 			{"usage", "", 0, "Show usage"},
 			{"help", "?", 0, "Show help"},
@@ -67,18 +122,60 @@ int main(int argc, const char *argv[])
 			exit(1);
 		}
 
-		int s = 2, n = 1000000;
+		struct tpcbspec spec = {};
+		int backend = pm_volatile;
 
 		for (int i = 0; i < optc; i++) {
 			struct option *option = options + optindex(optv, i);
 			switch (option->terse[0]) {
 			case 's':
-				s = atoi(optvalue(optv, i));
-				trace_off("sf: %i", s);
+				spec.scale = atoi(optvalue(optv, i));
+				trace_off("sf: %i", spec.scale);
 				break;
 			case 'n':
-				n = atoi(optvalue(optv, i));
-				trace_off("steps: '%i'", n);
+				spec.steps = atoi(optvalue(optv, i));
+				trace_off("steps: '%i'", spec.steps);
+				break;
+			case 'b':
+				spec.bulk = 1;
+				break;
+			case 'p':
+				spec.pool = atoi(optvalue(optv, i));
+				break;
+			case 'o':
+				spec.direct = 1;
+				break;
+			case 'l':
+				spec.logorder = atoi(optvalue(optv, i));
+				if (spec.logorder < logorder_min || spec.logorder > logorder_max)
+					error_exit(1, "log order must be %u to %u", logorder_min, logorder_max);
+				break;
+			case 'L':
+				spec.loglanes = atoi(optvalue(optv, i));
+				if (!spec.loglanes || spec.loglanes > loglanes_max)
+					error_exit(1, "log lanes must be 1 to %u", loglanes_max);
+				break;
+			case 'm':
+				spec.cache = atoi(optvalue(optv, i));
+				break;
+			case 't':
+				spec.threads = atoi(optvalue(optv, i));
+				break;
+			case 'w':
+				spec.workers = atoi(optvalue(optv, i));
+				break;
+			case 'r':
+				spec.remote = atoi(optvalue(optv, i));
+				if (spec.remote > 100)
+					error_exit(1, "remote percent must be at most 100");
+				break;
+			case 'D':
+				spec.duration = atoi(optvalue(optv, i));
+				break;
+			case 'd':
+				backend = pm_backend_parse(optvalue(optv, i));
+				if (backend < 0)
+					error_exit(1, "unknown durability backend '%s'", optvalue(optv, i));
 				break;
 			case 'V':
 				printf("Shardmap tpcb benchmark by Daniel Phillips: version 0.0\n");
@@ -95,19 +192,176 @@ int main(int argc, const char *argv[])
 		if (argc <= 2)
 			error_exit(1, "Usage: tcpv <filepath> --sf=<scale> --n=<steps>");
 
-		int fds[5] = {};
-		for (int i = 0; i < 5; i++) {
-			const std::string path = std::string(argv[2]) + std::to_string(i);
-			const char *cpath = path.c_str();
-			trace_on("path: %s", cpath);
-			if ((fds[i] = open(cpath, O_CREAT|O_RDWR, 0644)) < 0)
-				error_exit(1, "could not create %s tables (%s)", cpath, strerror(errno));
-			trace("fd %i", fds[i]);
+		pmem_setup((enum pm_backend)backend);
+		maint_setup(spec.workers);
+		trace_on("tpcb_run sf %i steps %i durability %s flush %s", spec.scale, spec.steps,
+			pm_backend_name[pmconfig.backend], pm_flush_name[pmconfig.flush]);
+		int err = tpcb_run(argv[2], spec);
+		maint_shutdown();
+		return !!err;
+	}
+
+	if (argc > 1 && !strcmp("bench", argv[1])) {
+		struct option options[] = {
+			{"workload", "w", OPT_HASARG, "Ycsb workload mix, a to f", "a"},
+			{"records", "r", OPT_HASARG|OPT_NUMBER, "Records loaded before the run", "100000"},
+			{"ops", "n", OPT_HASARG|OPT_NUMBER, "Operations measured", "1000000"},
+			{"warmup", "W", OPT_HASARG|OPT_NUMBER, "Operations run before measuring", "100000"},
+			{"threads", "t", OPT_HASARG|OPT_NUMBER, "Threads, each with its own table", "1"},
+			{"distribution", "D", OPT_HASARG, "Key choice (uniform, zipfian, latest), default per workload"},
+			{"keysize", "k", OPT_HASARG|OPT_NUMBER, "Key bytes", "16"},
+			{"valuesize", "v", OPT_HASARG|OPT_NUMBER, "Value bytes", "100"},
+			{"scanmax", "S", OPT_HASARG|OPT_NUMBER, "Longest scan, lengths uniform from one", "100"},
+			{"cores", "c", OPT_HASARG|OPT_NUMBER, "Shared nothing workers owning all tables, threads become clients"},
+			{"depth", "q", OPT_HASARG|OPT_NUMBER, "Requests each client keeps in flight with --cores", "1"},
+			{"durability", "d", OPT_HASARG, "Durability backend (volatile, pmem, pagecache, emulate[:ns[:MB/s]])", "volatile"},
+			{"json", "j", 0, "Report as one json object"},
+			{"timing", "T", 0, "Report internal event latency"},
+			{"logorder", "l", OPT_HASARG|OPT_NUMBER, "Microlog entries per lane as power of 2, unify batch is half", "9"},
+			{"loglanes", "L", OPT_HASARG|OPT_NUMBER, "Microlog lanes, each thread commits to one", "1"},
+			{"cache", "m", OPT_HASARG|OPT_NUMBER, "Shard cache KiB per table, evicting clean shards beyond it, 0 for no limit", "0"},
+			{"usage", "", 0, "Show usage"},
+			{"help", "?", 0, "Show help"},
+			{}};
+
+		char optv[1000];
+		int optc = optscan(options, &argc, (const char ***)&argv, optv, sizeof(optv));
+
+		if (optc < 0) {
+			printf("%s!\n", opterror(optv));
+			exit(1);
+		}
+
+		struct benchspec spec = {};
+		int backend = pm_volatile;
+
+		for (int i = 0; i < optc; i++) {
+			struct option *option = options + optindex(optv, i);
+			const char *value = optvalue(optv, i);
+			switch (option->terse[0]) {
+			case 'w':
+				spec.workload = value[0] | 0x20;
+				if (strlen(value) != 1 || spec.workload < 'a' || spec.workload > 'f')
+					error_exit(1, "workload must be one of a to f");
+				break;
+			case 'r':
+				spec.records = atoi(value);
+				break;
+			case 'n':
+				spec.ops = atoi(value);
+				break;
+			case 'W':
+				spec.warmup = atoi(value);
+				break;
+			case 't':
+				spec.threads = atoi(value);
+				break;
+			case 'D':
+				if ((spec.distribution = bench_distribution(value)) < 0)
+					error_exit(1, "unknown distribution '%s'", value);
+				break;
+			case 'k':
+				spec.keysize = atoi(value);
+				break;
+			case 'v':
+				spec.valuesize = atoi(value);
+				break;
+			case 'S':
+				spec.scanmax = atoi(value);
+				break;
+			case 'c':
+				spec.cores = atoi(value);
+				break;
+			case 'q':
+				spec.depth = atoi(value);
+				break;
+			case 'd':
+				backend = pm_backend_parse(value);
+				if (backend < 0)
+					error_exit(1, "unknown durability backend '%s'", value);
+				break;
+			case 'j':
+				spec.json = 1;
+				break;
+			case 'T':
+				spec.timing = 1;
+				break;
+			case 'l':
+				spec.logorder = atoi(value);
+				if (spec.logorder < logorder_min || spec.logorder > logorder_max)
+					error_exit(1, "log order must be %u to %u", logorder_min, logorder_max);
+				break;
+			case 'L':
+				spec.loglanes = atoi(value);
+				if (!spec.loglanes || spec.loglanes > loglanes_max)
+					error_exit(1, "log lanes must be 1 to %u", loglanes_max);
+				break;
+			case 'm':
+				spec.cache = atoi(value);
+				break;
+			case '?':
+				usage(options, argv[0], " bench <filename> [OPTIONS]");
+				exit(0);
+			case 0:
+				usage(options, argv[0], 0);
+				exit(0);
+			}
+		}
+
+		if (argc <= 2)
+			error_exit(1, "Usage: %s bench <filepath> [OPTIONS]", argv[0]);
+
+		pmem_setup((enum pm_backend)backend);
+		int err = bench_run(argv[2], spec);
+		maint_shutdown();
+		return !!err;
+	}
+
+	if (argc > 1 && !strcmp("inspect", argv[1])) {
+		struct option options[] = {
+			{"threads", "t", OPT_HASARG|OPT_NUMBER, "Threads, default one per cpu"},
+			{"json", "j", 0, "Report as one json object"},
+			{"verbose", "v", 0, "Report each shard"},
+			{"usage", "", 0, "Show usage"},
+			{"help", "?", 0, "Show help"},
+			{}};
+
+		char optv[1000];
+		int optc = optscan(options, &argc, (const char ***)&argv, optv, sizeof(optv));
+
+		if (optc < 0) {
+			printf("%s!\n", opterror(optv));
+			exit(1);
 		}
 
-		trace_on("tpcb_run sf %i steps %i", s, n);
-		int tpcb_run(int fds[4], unsigned scalefactor, unsigned iterations);
-		return !!tpcb_run(fds, s, n);
+		unsigned threads = 0;
+		bool json = 0, verbose = 0;
+
+		for (int i = 0; i < optc; i++) {
+			struct option *option = options + optindex(optv, i);
+			switch (option->terse[0]) {
+			case 't':
+				threads = atoi(optvalue(optv, i));
+				break;
+			case 'j':
+				json = 1;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			case '?':
+				usage(options, argv[0], " inspect <filename> [OPTIONS]");
+				exit(0);
+			case 0:
+				usage(options, argv[0], 0);
+				exit(0);
+			}
+		}
+
+		if (argc <= 2)
+			error_exit(1, "Usage: %s inspect <filepath> [OPTIONS]", argv[0]);
+
+		return !!inspect_run(argv[2], threads, json, verbose);
 	}
 
 	if (0) {
@@ -269,7 +523,27 @@ using namespace std;
 
 #include <sys/time.h>
 
-int tpcb_run(int fds[5], unsigned scalefactor, unsigned iterations)
+/*
+ * Tpc-b style benchmark. Branches are dealt out round robin to partitions,
+ * one per client thread, each with its own branch, teller, account and
+ * history tables and transaction log in its own files. A client runs the
+ * transactions of its own tellers, so branch, teller and history updates
+ * never leave the partition. The account is at the teller's branch except
+ * for the remote share, where it is at a random other branch, possibly in
+ * another partition. A keymap is not safe for concurrent use, so account
+ * tables are the only shared state and each is guarded by its own lock,
+ * held for lookup, update and change notice. A client holds at most one
+ * lock at a time so there is no lock order to get wrong.
+ */
+
+#include <thread>
+#include <mutex>
+#include <algorithm>
+
+static u64 nanotime();
+static u32 percentile(std::vector<u32> &sorted, double fraction);
+
+int tpcb_run(const char *path, const struct tpcbspec &spec)
 {
 	/*
 	 * Bench setup parameters
@@ -296,7 +570,9 @@ int tpcb_run(int fds[5], unsigned scalefactor, unsigned iterations)
 			.locbits = 12,
 			.sigbits = 50},
 
-		.lower = {}
+		.lower = {},
+		.logorder = (u8)spec.logorder,
+		.loglanes = (u8)spec.loglanes,
 	};
 
 	typedef u32 id;
@@ -311,119 +587,863 @@ int tpcb_run(int fds[5], unsigned scalefactor, unsigned iterations)
 	assert(sizeof(struct teller) == 100);
 	assert(sizeof(struct transaction) == 50);
 
+	unsigned scalefactor = spec.scale, parts = spec.threads;
+	if (!scalefactor || !parts || parts > scalefactor)
+		error_exit(1, "need at least one branch per client thread");
+
+	struct partition
+	{
+		struct header head, acchead; // referenced by the keymaps for their lifetime
+		struct keymap *branches, *accounts, *tellers, *history;
+		std::mutex accounts_lock; // remote transactions reach other partitions
+		struct pmblock *xlog; // redo log in its own file
+		struct layout xlog_layout;
+		unsigned retail = 0; // redo log tail
+		std::vector<unsigned> branch_index, teller_index; // global branch by local branch and teller
+		std::vector<id> teller_id;
+		std::vector<u32> latency; // nanoseconds
+		u64 done = 0;
+	};
+
 	/*
-	 * Transaction log in its own file
+	 * One file per table per partition, the first partition without suffix
 	 */
-	struct pmblock *xlog;
-	struct layout xlog_layout;
-	xlog_layout.map.push_back({microlog_size, 12, (void **)&xlog, NULL});
-	xlog_layout.do_maps(fds[0]);
-	unsigned retail = 0; // redo log tail
+	std::vector<struct partition *> partitions;
+	for (unsigned p = 0; p < parts; p++) {
+		struct partition *part = new struct partition;
+		int fds[5];
+		for (int i = 0; i < 5; i++) {
+			const std::string name = std::string(path) + std::to_string(i) + (p ? "." + std::to_string(p) : "");
+			trace_on("path: %s", name.c_str());
+			if ((fds[i] = open(name.c_str(), O_CREAT|O_RDWR, 0644)) < 0)
+				error_exit(1, "could not create %s tables (%s)", name.c_str(), strerror(errno));
+		}
+		part->xlog_layout.map.push_back({microlog_size, 12, (void **)&part->xlog, NULL});
+		part->xlog_layout.do_maps(fds[0]);
+
+		u64 branches = scalefactor / parts + (p < scalefactor % parts);
+		part->head = part->acchead = head;
+		if (spec.bulk && keymap::bulk_geometry(part->acchead, branches * a_per_b, 100, sizeof(id)))
+			error_exit(1, "too many accounts to bulk load in one partition");
+		part->branches = new keymap(part->head, fds[1], fixsize::recops, 100);
+		part->accounts = new keymap(part->acchead, fds[2], fixsize::recops, 100);
+		if (spec.pool && part->accounts->set_pool(spec.pool, spec.direct))
+			error_exit(1, "could not set up block pool of %u frames", spec.pool);
+		part->tellers = new keymap(part->head, fds[3], fixsize::recops, 100);
+		part->history = new keymap(part->head, fds[4], fixsize::recops, 50);
+		for (struct keymap *map: {part->branches, part->accounts, part->tellers, part->history})
+			map->set_cache_budget((u64)spec.cache << 10);
+		partitions.push_back(part);
+	}
 
 	/*
-	 * One kvs table per file
+	 * Generate initial database prior to steady state bench, partitions
+	 * in parallel. Ids are global: branch n has ids from n * per branch.
 	 */
-	trace("branches...");
-	struct keymap branches{head, fds[1], fixsize::recops, 100};
-	trace("accounts...");
-	struct keymap accounts{head, fds[2], fixsize::recops, 100};
-	trace("tellers...");
-	struct keymap tellers{head, fds[3], fixsize::recops, 100};
-	trace("history...");
-	struct keymap history{head, fds[4], fixsize::recops, 50};
+	auto load = [&](struct partition *part, unsigned p) {
+		for (unsigned n = p; n < scalefactor; n += parts) {
+			id bid = n + 1;
+			struct branch data = { bid };
+			memset(data.pad, filler, sizeof data.pad);
+			part->branches->insert(&bid, 4, &data);
+			part->branch_index.push_back(n);
+
+			for (id tid = n * t_per_b + 1; tid <= (n + 1) * t_per_b; tid++) {
+				struct teller data = { tid, bid };
+				memset(data.pad, filler, sizeof data.pad);
+				part->tellers->insert(&tid, 4, &data);
+				part->teller_index.push_back(n);
+				part->teller_id.push_back(tid);
+			}
+		}
+
+		struct account data = { 0 };
+		memset(data.pad, filler, sizeof data.pad);
+		unsigned n = p, next = 0;
+		auto source = [&](const void *&key, unsigned &keylen, const void *&rec) -> bool {
+			if (next == a_per_b) {
+				next = 0;
+				n += parts;
+			}
+			if (n >= scalefactor)
+				return 0;
+			data.aid = (id)n * a_per_b + ++next;
+			data.bid = n + 1;
+			key = &data.aid;
+			keylen = sizeof data.aid;
+			rec = &data;
+			return 1;
+		};
+		if (spec.bulk) {
+			part->accounts->bulk_load(source);
+			return;
+		}
+		const void *key, *rec;
+		unsigned keylen;
+		while (source(key, keylen, rec))
+			part->accounts->insert(key, keylen, rec);
+	};
 
 	/*
-	 * Provide these lists to driver to generate transactions
+	 * The benchmark proper (driver and transactions)
 	 */
-	vector<id> branch_id;
-	vector<vector<id_t>> accounts_by_branch;
-	vector<unsigned> teller_branch;
-	vector<id> teller_id;
+	u64 deadline = 0; // set once loaded
+	auto client = [&](struct partition *part, unsigned p) {
+		unsigned rand = seed + p, teller_count = part->teller_id.size();
+		u64 steps = deadline ? -1ULL : spec.steps / parts + (p < spec.steps % parts);
+		part->latency.reserve(deadline ? 1 << 20 : steps);
+
+		for (id hid = 1; hid <= steps; hid++) {
+			u64 start = nanotime();
+			if (deadline && start >= deadline)
+				break;
+
+			/* generate a random transaction, remote share at another branch */
+			unsigned i = rand_r(&rand) % teller_count, j = part->teller_index[i];
+			unsigned home = j;
+			if (scalefactor > 1 && (unsigned)rand_r(&rand) % 100 < spec.remote)
+				home = (j + 1 + rand_r(&rand) % (scalefactor - 1)) % scalefactor;
+			id aid = (id)home * a_per_b + 1 + rand_r(&rand) % a_per_b;
+			id bid = j + 1;
+			id tid = part->teller_id[i];
+			long delta_min = -999999, delta_max = +999999;
+			long delta = (rand_r(&rand) % (unsigned)(delta_max - delta_min + 1)) + delta_min;
+			struct partition *other = partitions[home % parts];
+
+			/* Acquire transaction resources (one record from each of three tables) */
+			rec_t *rec;
+			struct query { struct account *a; struct branch *b; struct teller *t; } query = {};
+			if ((rec = part->branches->lookup(&bid, 4)))
+				query.b = (struct branch *)rec;
+			if ((rec = part->tellers->lookup(&tid, 4)))
+				query.t = (struct teller *)rec;
+			std::unique_lock<std::mutex> guard(other->accounts_lock);
+			if ((rec = other->accounts->lookup(&aid, 4)))
+				other->accounts->pin(query.a = (struct account *)rec); // pool frame held until unpin
+			if ((!query.a|!query.b|!query.t))
+				error_exit(1, "*** abort hid %u: aid %u bid %u tid %u (%i-%i-%i)",
+					hid, aid, bid, tid, !!query.a, !!query.b, !!query.t);
+
+			/* All resources were acquired so transaction is now guaranteed to succeed */
+			/* Log redo record for replay in case of crash */
+			struct redo { id hid, aid, tid, bid; cash delta, a, b, t; };
+			struct redo redo = {hid, aid, tid, bid, delta, query.a->balance, query.b->balance, query.t->balance };
+			log_commit(part->xlog, logorder_default, &redo, sizeof redo, &part->retail);
+
+			/* update balances in memory mapped records, then make them persistent */
+			query.a->balance += delta;
+			other->accounts->changed(&query.a->balance, sizeof query.a->balance);
+			cash balance = query.a->balance;
+			other->accounts->unpin(query.a);
+			guard.unlock();
+			query.b->balance += delta;
+			query.t->balance += delta;
+			part->branches->changed(&query.b->balance, sizeof query.b->balance);
+			part->tellers->changed(&query.t->balance, sizeof query.t->balance);
+
+			/* log transaction history (use an ordinary file in real life) */
+			struct timeval tv;
+			gettimeofday(&tv, NULL);
+			struct transaction transaction = { aid, tid, bid, balance, tv };
+			part->history->insert(&hid, 4, &transaction);
+			part->latency.push_back(std::min(nanotime() - start, (u64)UINT32_MAX));
+			part->done++;
+		}
+	};
+
+	auto phase = [&](std::function<void(struct partition *, unsigned)> fn) {
+		std::vector<std::thread> workers;
+		u64 start = nanotime();
+		for (unsigned p = 0; p < parts; p++)
+			workers.emplace_back(fn, partitions[p], p);
+		for (std::thread &worker: workers)
+			worker.join();
+		return (nanotime() - start) / 1e9;
+	};
+
+	double loaded = phase(load);
+	trace_on("loaded %u branches in %.3f seconds", scalefactor, loaded);
+	if (spec.duration)
+		deadline = nanotime() + spec.duration * 1000000000ULL;
+	double secs = phase(client);
+
+	u64 done = 0;
+	std::vector<u32> latency;
+	for (struct partition *part: partitions) {
+		done += part->done;
+		latency.insert(latency.end(), part->latency.begin(), part->latency.end());
+	}
+	std::sort(latency.begin(), latency.end());
+	printf("%lu transactions in %.3f seconds, %.0f per second (%s), %u clients, %u%% remote\n",
+		done, secs, done / secs, pm_backend_name[pmconfig.backend], parts, spec.remote);
+	if (done)
+		printf("transaction latency us p50 %.2f p90 %.2f p99 %.2f p999 %.2f max %.2f\n",
+			percentile(latency, 0.5) / 1e3, percentile(latency, 0.9) / 1e3, percentile(latency, 0.99) / 1e3,
+			percentile(latency, 0.999) / 1e3, latency.back() / 1e3);
+	emulation_report();
+	struct maintstats maint = maint_stats();
+	printf("maintenance %lu tasks (%lu reshard parts, %lu unify), %lu stolen, %lu helped, %lu waited\n",
+		maint.tasks, maint.ran[maint_cpu], maint.ran[maint_io], maint.stolen, maint.helped, maint.waited);
 
 	/*
-	 * Generate initial database prior to steady state bench
+	 * Every transaction applies the same delta to one row of each table,
+	 * so balance totals of the three tables must agree
 	 */
-	id bid = 1, tid = 1, aid = 1;
+	struct scansum b = {}, t = {}, a = {};
+	for (struct partition *part: partitions) {
+		struct scansum sum;
+		part->branches->scan({scanspec::all, 0, 0, offsetof(struct branch, balance)}, sum);
+		b.sum += sum.sum, b.records += sum.records;
+		part->tellers->scan({scanspec::all, 0, 0, offsetof(struct teller, balance)}, sum);
+		t.sum += sum.sum, t.records += sum.records;
+		part->accounts->scan({scanspec::all, 0, 0, offsetof(struct account, balance)}, sum);
+		a.sum += sum.sum, a.records += sum.records;
+	}
+	printf("balance branches %li (%lu) tellers %li (%lu) accounts %li (%lu)\n",
+		b.sum, b.records, t.sum, t.records, a.sum, a.records);
+	if (b.sum != t.sum || b.sum != a.sum)
+		error_exit(1, "balance totals disagree");
 
-	for (unsigned n = 0; n < scalefactor; n++, bid++) {
-		struct branch data = { bid };
-		memset(data.pad, filler, sizeof data.pad);
-		branches.insert(&bid, 4, &data);
-		branch_id.push_back(bid);
+	/*
+	 * The scan reads record blocks, not the index. With a cache budget,
+	 * drop every account shard, then lift the budget and look up every
+	 * account by key, so each shard is repopulated from media once, and
+	 * check the index finds the same total.
+	 */
+	if (spec.cache) {
+		cash sum = 0;
+		u64 evicted = 0, populated = 0;
+		for (struct partition *part: partitions) {
+			part->accounts->set_cache_budget(1);
+			part->accounts->set_cache_budget(0);
+		}
+		for (id aid = 1; aid <= scalefactor * a_per_b; aid++) {
+			struct partition *part = partitions[(aid - 1) / a_per_b % parts];
+			struct account *rec = (struct account *)part->accounts->lookup(&aid, sizeof aid);
+			if (!rec || rec->aid != aid)
+				error_exit(1, "account %u not found by lookup", aid);
+			sum += rec->balance;
+		}
+		for (struct partition *part: partitions) {
+			struct keystats stats = part->accounts->stats();
+			evicted += stats.counter[stat_evict];
+			populated += stats.counter[stat_populate];
+		}
+		printf("lookup accounts %li, %lu shards evicted, %lu populated\n", sum, evicted, populated);
+		if (sum != a.sum)
+			error_exit(1, "account lookups disagree with scan");
+	}
 
-		for (int i = 0; i < t_per_b; i++) {
-			struct teller data = { tid, bid };
-			memset(data.pad, filler, sizeof data.pad);
-			tellers.insert(&tid, 4, &data);
-			teller_branch.push_back(n);
-			teller_id.push_back(tid);
-			tid++;
+	printf("shard tables %lu bytes in use, %lu mapped (%lu hugetlb, %lu thp), %lu allocs %lu recycled\n",
+		tablestats.inuse, tablestats.mapped, tablestats.hugetlb, tablestats.advised,
+		tablestats.allocs, tablestats.recycled);
+
+	struct poolstats pool = {};
+	for (struct partition *part: partitions) {
+		if (spec.pool) {
+			struct poolstats ps = part->accounts->pool_stats();
+			pool.frames += ps.frames, pool.hits += ps.hits, pool.misses += ps.misses;
+			pool.reads += ps.reads, pool.writes += ps.writes;
 		}
+		delete part->branches;
+		delete part->accounts;
+		delete part->tellers;
+		delete part->history;
+		delete part;
+	}
+	if (spec.pool)
+		printf("accounts pool %lu frames, %lu hits %lu misses, %lu blocks read %lu written\n",
+			pool.frames, pool.hits, pool.misses, pool.reads, pool.writes);
 
-		vector<id> accounts_at_branch;
+	return 0;
+}
 
-		for (int i = 0; i < a_per_b; i++) {
-			struct account data = { aid, bid };
-			memset(data.pad, filler, sizeof data.pad);
-			accounts.insert(&aid, 4, &data);
-			accounts_at_branch.push_back(aid);
-			aid++;
+/*
+ * Ycsb style benchmark. Workload mixes follow the ycsb core workloads:
+ *
+ *   a: 50% read, 50% update, zipfian
+ *   b: 95% read, 5% update, zipfian
+ *   c: 100% read, zipfian
+ *   d: 95% read, 5% insert, latest
+ *   e: 95% scan, 5% insert, zipfian
+ *   f: 50% read, 50% read-modify-write, zipfian
+ *
+ * A keymap is not safe for concurrent writers, so each thread runs its own
+ * table in its own file, holding a share of the records and operations, as
+ * a hash partitioned store would. Scans run in hash order from the key,
+ * being the only order there is. Latency is measured per operation with a
+ * monotonic clock and reported as percentiles per operation kind.
+ */
+
+#include <thread>
+#include <algorithm>
+#include <math.h>
+#include <unistd.h>
+
+enum bench_op {op_read, op_update, op_insert, op_scan, op_rmw, bench_ops};
+static const char *bench_op_name[] = {"read", "update", "insert", "scan", "rmw"};
+static const char *bench_dist_name[] = {"uniform", "zipfian", "latest"};
+
+static const struct benchmix { char name; u8 percent[bench_ops]; enum bench_dist dist; } benchmixes[] = {
+	{'a', {50, 50, 0, 0, 0}, dist_zipfian},
+	{'b', {95, 5, 0, 0, 0}, dist_zipfian},
+	{'c', {100, 0, 0, 0, 0}, dist_zipfian},
+	{'d', {95, 0, 5, 0, 0}, dist_latest},
+	{'e', {0, 0, 5, 95, 0}, dist_zipfian},
+	{'f', {50, 0, 0, 0, 50}, dist_zipfian},
+};
+
+int bench_distribution(const char *name)
+{
+	for (unsigned i = 0; i < sizeof bench_dist_name / sizeof *bench_dist_name; i++)
+		if (!strcmp(name, bench_dist_name[i]))
+			return i;
+	return -EINVAL;
+}
+
+static u64 nanotime()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* xorshift64*, one per thread */
+struct benchrand
+{
+	u64 state;
+	u64 next() { state ^= state >> 12; state ^= state << 25; state ^= state >> 27; return state * 0x2545f4914f6cdd1dULL; }
+	double unit() { return (next() >> 11) * (1.0 / (1ULL << 53)); }
+};
+
+/*
+ * Zipfian item choice after Gray et al, "Quickly generating billion-record
+ * synthetic databases", as ycsb does, with theta 0.99. Item zero is the
+ * most popular. Zeta is extended incrementally as items are added.
+ */
+struct zipfian
+{
+	enum {theta_percent = 99};
+	double theta = theta_percent / 100.0, zetan = 0, zeta2, alpha, eta;
+	u64 items = 0;
+
+	zipfian(u64 n)
+	{
+		zeta2 = 1 + pow(0.5, theta);
+		alpha = 1 / (1 - theta);
+		grow(n);
+	}
+
+	void grow(u64 n)
+	{
+		for (; items < n; items++)
+			zetan += pow(items + 1, -theta);
+		eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+	}
+
+	u64 next(struct benchrand &rand)
+	{
+		double u = rand.unit(), uz = u * zetan;
+		if (uz < 1)
+			return 0;
+		if (uz < zeta2)
+			return 1;
+		return std::min(items - 1, (u64)(items * pow(eta * u - eta + 1, alpha)));
+	}
+};
+
+/* Spread popular items over the key space, as ycsb scrambled zipfian does */
+static u64 fnv64(u64 n)
+{
+	u64 hash = 0xcbf29ce484222325ULL;
+	for (unsigned i = 0; i < 8; i++, n >>= 8)
+		hash = (hash ^ (n & 0xff)) * 0x100000001b3ULL;
+	return hash;
+}
+
+struct benchthread
+{
+	const struct benchspec &spec;
+	const struct benchmix &mix;
+	unsigned id, dist;
+	int fd;
+	struct header head; // referenced by the keymap for its lifetime
+	struct keymap *map; // own table, or
+	struct coremap *core; // client of shared nothing workers
+	struct benchrand rand;
+	struct zipfian zipf;
+	u64 count; // keys in this table
+	std::vector<u32> latency[bench_ops]; // nanoseconds
+	u64 scanned = 0, missing = 0;
+	char key[256];
+	u8 value[256];
+
+	benchthread(const struct benchspec &spec, const struct benchmix &mix, unsigned id, int fd, const struct header &head,
+			struct coremap *core = NULL) :
+		spec(spec), mix(mix), id(id), dist(spec.distribution < 0 ? mix.dist : spec.distribution), fd(fd),
+		head(head), map(core ? NULL : new keymap(this->head, fd, fixsize::recops, spec.valuesize)), core(core),
+		rand{0x9e3779b97f4a7c15ULL * (id + 1)}, zipf(std::max(share(spec.records), 1U)), count(0)
+	{
+		memset(value, 'v', sizeof value);
+		if (map)
+			map->set_cache_budget((u64)spec.cache << 10);
+	}
+
+	~benchthread()
+	{
+		delete map;
+		if (fd >= 0)
+			close(fd);
+	}
+
+	unsigned share(unsigned total) { return total / spec.threads + (id < total % spec.threads); }
+
+	/* Keys of all tables are distinct, as if partitioned from one key space */
+	unsigned makekey(u64 i)
+	{
+		u64 global = i * spec.threads + id;
+		int len = snprintf(key, sizeof key, "user%0*lu", spec.keysize - 4, global);
+		return std::min((unsigned)len, spec.keysize);
+	}
+
+	u64 choose()
+	{
+		switch (dist) {
+		case dist_uniform:
+			return rand.next() % count;
+		case dist_latest:
+			zipf.grow(count);
+			return count - 1 - zipf.next(rand);
+		default:
+			return fnv64(zipf.next(rand)) % count;
+		}
+	}
+
+	void load()
+	{
+		if (core)
+			return corerun(share(spec.records), 0, 1);
+		for (unsigned n = share(spec.records); count < n; count++) {
+			unsigned len = makekey(count);
+			if (is_errcode(map->insert(key, len, value)))
+				error_exit(1, "load insert failed");
 		}
+	}
 
-		accounts_by_branch.push_back(accounts_at_branch);
+	enum bench_op pick()
+	{
+		unsigned roll = rand.next() % 100, op = 0;
+		while (roll >= mix.percent[op])
+			roll -= mix.percent[op++];
+		return (enum bench_op)op;
+	}
+
+	void step(enum bench_op op)
+	{
+		unsigned len;
+		rec_t *rec;
+
+		switch (op) {
+		case op_insert:
+			len = makekey(count++);
+			if (is_errcode(map->insert(key, len, value)))
+				error_exit(1, "insert failed");
+			break;
+		case op_scan: {
+			struct cursor cursor;
+			len = makekey(choose());
+			map->seek(cursor, key, len);
+			auto fn = [](void *context, u8 *key, unsigned keylen, u8 *data, unsigned reclen) {
+				(*(u64 *)context)++;
+			};
+			map->iterate(cursor, 1 + rand.next() % spec.scanmax, fn, &scanned);
+			break;
+		}
+		default:
+			len = makekey(choose());
+			if (!(rec = map->lookup(key, len))) {
+				missing++;
+				break;
+			}
+			if (op == op_rmw)
+				value[0] = rec[0] + 1;
+			if (op == op_update || op == op_rmw) {
+				memcpy(rec, value, spec.valuesize);
+				map->changed(rec, spec.valuesize);
+			}
+		}
 	}
 
 	/*
-	 * The benchmark proper (driver and transactions)
+	 * Keep up to depth requests in flight through the shared nothing
+	 * workers. Read modify write is a lookup then an update from the
+	 * same slot, timed from the first submit to the second completion.
 	 */
-	unsigned teller_count = teller_id.size();
-	srand(seed);
-
-	for (id hid = 1; hid <= iterations; hid++) {
-		/* generate a random transaction. Note! 100% local transactions for now */
-		unsigned i = rand() % teller_count, j = teller_branch[i];
-		unsigned a = rand() % accounts_by_branch[j].size();
-		id aid = accounts_by_branch[j][a];
-		id bid = branch_id[j];
-		id tid = teller_id[i];
-		long delta_min = -999999, delta_max = +999999;
-		long delta = (rand() % (unsigned)(delta_max - delta_min + 1)) + delta_min;
-
-		/* Acquire transaction resources (one record from each of three tables) */
-		rec_t *rec;
-		struct query { struct account *a; struct branch *b; struct teller *t; } query = {};
-		if ((rec = accounts.lookup(&aid, 4)))
-			query.a = (struct account *)rec;
-		if ((rec = branches.lookup(&bid, 4)))
-			query.b = (struct branch *)rec;
-		if ((rec = tellers.lookup(&tid, 4)))
-			query.t = (struct teller *)rec;
-		if ((!query.a|!query.b|!query.t))
-			error_exit(1, "*** abort hid %u: aid %u bid %u tid %u (%i-%i-%i)",
-				hid, aid, bid, tid, !!query.a, !!query.b, !!query.t);
-
-		/* All resources were acquired so transaction is now guaranteed to succeed */
-		/* Log redo record for replay in case of crash */
-		struct redo { id hid, aid, tid, bid; cash delta, a, b, t; };
-		struct redo redo = {hid, aid, tid, bid, delta, query.a->balance, query.b->balance, query.t->balance };
-		log_commit(xlog, &redo, sizeof redo, &retail);
-
-		/* update balances in memory mapped records */
-		query.a->balance += delta;
-		query.b->balance += delta;
-		query.t->balance += delta;
-
-		/* make update persistent */
-		clwb(&query.a->balance);
-		clwb(&query.b->balance);
-		clwb(&query.t->balance);
-
-		/* log transaction history (use an ordinary file in real life) */
-		struct timeval tv;
-		gettimeofday(&tv, NULL);
-		struct transaction transaction = { aid, tid, bid, query.a->balance, tv };
-		history.insert(&hid, 4, &transaction);
+	struct coreslot { enum bench_op op; bool second; unsigned len; u64 start; char key[256]; u8 data[256]; };
+
+	void corerun(unsigned ops, bool measure, bool loading)
+	{
+		enum {poll_max = 64};
+		std::vector<struct coreslot> slots(spec.depth);
+		std::vector<unsigned> idle;
+		for (unsigned i = 0; i < spec.depth; i++)
+			idle.push_back(i);
+		struct coredone done[poll_max];
+
+		auto request = [&](unsigned tag) {
+			struct coreslot &slot = slots[tag];
+			struct corereq req = {corereq::lookup, (u8)slot.len, tag, slot.key, slot.data};
+			if (slot.op == op_insert)
+				req.op = corereq::insert, req.data = value;
+			else if (slot.op == op_update)
+				req.op = corereq::update, req.data = value;
+			else if (slot.second)
+				req.op = corereq::update;
+			return req;
+		};
+
+		for (unsigned issued = 0, finished = 0, wait = 0; finished < ops;) {
+			for (; issued < ops && !idle.empty(); issued++) {
+				unsigned tag = idle.back();
+				struct coreslot &slot = slots[tag];
+				slot.op = loading ? op_insert : pick();
+				slot.len = makekey(slot.op == op_insert ? count++ : choose());
+				slot.second = 0;
+				memcpy(slot.key, key, slot.len);
+				slot.start = measure ? nanotime() : 0;
+				if (!core->submit(id, request(tag)))
+					break;
+				idle.pop_back();
+			}
+			core->flush(id);
+
+			unsigned n = core->poll(id, done, poll_max);
+			for (unsigned i = 0; i < n; i++) {
+				struct coreslot &slot = slots[done[i].tag];
+				if (slot.op == op_insert && done[i].status)
+					error_exit(1, "insert failed (%s)", strerror(-done[i].status));
+				if (done[i].status == -ENOENT)
+					missing++;
+				else if (slot.op == op_rmw && !slot.second) {
+					slot.second = 1;
+					slot.data[0]++;
+					if (core->submit(id, request(done[i].tag)))
+						continue;
+					error_exit(1, "request ring full");
+				}
+				if (measure)
+					latency[slot.op].push_back(std::min(nanotime() - slot.start, (u64)UINT32_MAX));
+				idle.push_back(done[i].tag);
+				finished++;
+			}
+			if (n)
+				wait = 0;
+			else if (++wait > 256)
+				sched_yield();
+		}
+	}
+
+	void run(unsigned ops, bool measure)
+	{
+		if (core)
+			return corerun(ops, measure, 0);
+		for (unsigned i = 0; i < ops; i++) {
+			enum bench_op op = pick();
+			u64 start = measure ? nanotime() : 0;
+			step(op);
+			if (measure)
+				latency[op].push_back(std::min(nanotime() - start, (u64)UINT32_MAX));
+		}
+	}
+};
+
+/* Run one phase on every thread, returning elapsed seconds */
+static double bench_phase(std::vector<struct benchthread *> &threads, std::function<void(struct benchthread *)> fn)
+{
+	std::vector<std::thread> workers;
+	u64 start = nanotime();
+	for (struct benchthread *thread: threads)
+		workers.emplace_back([thread, &fn]() { fn(thread); });
+	for (std::thread &worker: workers)
+		worker.join();
+	return (nanotime() - start) / 1e9;
+}
+
+static u32 percentile(std::vector<u32> &sorted, double fraction)
+{
+	return sorted.empty() ? 0 : sorted[std::min(sorted.size() - 1, (size_t)(sorted.size() * fraction))];
+}
+
+int bench_run(const char *path, const struct benchspec &spec)
+{
+	enum {logent_room = sizeof(struct pmblock) - sizeof(cell_t) - 24}; // see insert_logent
+
+	const struct benchmix &mix = benchmixes[spec.workload - 'a'];
+	if (!spec.threads || !spec.records || !spec.scanmax)
+		error_exit(1, "threads, records and scan length must be at least one");
+	if (spec.records < spec.threads)
+		error_exit(1, "need at least one record per thread");
+	if (spec.keysize < 12 || spec.keysize + spec.valuesize > logent_room)
+		error_exit(1, "key size must be at least 12 and key plus value at most %u bytes", logent_room);
+	if (spec.cores && mix.percent[op_scan])
+		error_exit(1, "scans are not supported with shared nothing workers");
+	if (!spec.depth || spec.depth > 256)
+		error_exit(1, "depth must be 1 to 256");
+
+	struct header head = {
+		.magic = {'t', 'e', 's', 't'},
+		.version = 0,
+		.blockbits = 14,
+		.tablebits = 9,
+		.maxtablebits = 19,
+		.reshard = 1,
+		.rehash = 2,
+		.loadfactor = one_fixed8,
+		.blocks = 0,
+
+		.upper = {
+			.mapbits = 0,
+			.stridebits = 23,
+			.locbits = 12,
+			.sigbits = 50},
+
+		.lower = {},
+		.logorder = (u8)spec.logorder,
+		.loglanes = (u8)spec.loglanes,
+	};
+
+	std::vector<struct benchthread *> threads;
+	struct coremap *core = NULL;
+	if (spec.cores) {
+		core = new coremap(path, spec.cores, spec.threads, head, spec.valuesize);
+		core->each([&spec](unsigned i, struct keymap &map) { map.set_cache_budget((u64)spec.cache << 10); });
+		for (unsigned i = 0; i < spec.threads; i++)
+			threads.push_back(new struct benchthread(spec, mix, i, -1, head, core));
+	}
+	for (unsigned i = 0; !core && i < spec.threads; i++) {
+		const std::string name = std::string(path) + std::to_string(i);
+		int fd = open(name.c_str(), O_CREAT|O_RDWR|O_TRUNC, 0644);
+		if (fd < 0)
+			error_exit(1, "could not create %s (%s)", name.c_str(), strerror(errno));
+		threads.push_back(new struct benchthread(spec, mix, i, fd, head));
+	}
+
+	double load = bench_phase(threads, [](struct benchthread *thread) { thread->load(); });
+	bench_phase(threads, [](struct benchthread *thread) { thread->run(thread->share(thread->spec.warmup), 0); });
+	for (struct benchthread *thread: threads)
+		if (thread->map)
+			thread->map->set_timing(spec.timing);
+	if (core)
+		core->each([&spec](unsigned i, struct keymap &map) { map.set_timing(spec.timing); });
+	double secs = bench_phase(threads, [](struct benchthread *thread) { thread->run(thread->share(thread->spec.ops), 1); });
+
+	/* internal events of all tables in one set of histograms */
+	std::vector<struct histogram> events(spec.timing ? timed_events : 0);
+	double cycles_per_ns = 1;
+	u64 missing = 0, scanned = 0;
+	std::vector<u32> latency[bench_ops];
+	std::vector<std::string> tables; // keymap counters, all phases
+	auto tally = [&](struct keymap &map) {
+		if (spec.timing)
+			cycles_per_ns = map.timing->cycles_per_ns;
+		for (unsigned i = 0; i < events.size(); i++) {
+			const struct histogram *hist = map.histogram((enum timed_event)i);
+			for (unsigned j = 0; j < histogram::buckets; j++)
+				events[i].count[j] += hist->count[j];
+			events[i].samples += hist->samples;
+			events[i].total += hist->total;
+			events[i].max = std::max(events[i].max, hist->max);
+		}
+		if (spec.json)
+			tables.push_back(map.stats_json());
+	};
+	if (core)
+		core->each([&tally](unsigned i, struct keymap &map) { tally(map); });
+	for (struct benchthread *thread: threads) {
+		for (unsigned op = 0; op < bench_ops; op++)
+			latency[op].insert(latency[op].end(), thread->latency[op].begin(), thread->latency[op].end());
+		if (thread->map)
+			tally(*thread->map);
+		missing += thread->missing;
+		scanned += thread->scanned;
+		delete thread;
+	}
+	delete core;
+	for (unsigned op = 0; op < bench_ops; op++)
+		std::sort(latency[op].begin(), latency[op].end());
+
+	const char *dist = bench_dist_name[spec.distribution < 0 ? mix.dist : spec.distribution];
+	if (spec.json) {
+		printf("{\"workload\": \"%c\", \"distribution\": \"%s\", \"records\": %u, \"ops\": %u, \"warmup\": %u, "
+			"\"threads\": %u, \"cores\": %u, \"depth\": %u, \"keysize\": %u, \"valuesize\": %u, \"durability\": \"%s\", "
+			"\"load_ops_per_sec\": %.0f, \"ops_per_sec\": %.0f, \"missing\": %lu, \"scanned\": %lu, \"latency_ns\": {",
+			spec.workload, dist, spec.records, spec.ops, spec.warmup, spec.threads, spec.cores, spec.depth,
+			spec.keysize, spec.valuesize,
+			pm_backend_name[pmconfig.backend], spec.records / load, spec.ops / secs, missing, scanned);
+		const char *sep = "";
+		for (unsigned op = 0; op < bench_ops; op++) {
+			if (latency[op].empty())
+				continue;
+			printf("%s\"%s\": {\"count\": %lu, \"p50\": %u, \"p99\": %u, \"p999\": %u, \"max\": %u}",
+				sep, bench_op_name[op], latency[op].size(), percentile(latency[op], 0.5),
+				percentile(latency[op], 0.99), percentile(latency[op], 0.999), latency[op].back());
+			sep = ", ";
+		}
+		printf("}");
+		if (spec.timing) {
+			printf(", \"events_ns\": {");
+			sep = "";
+			for (unsigned i = 0; i < events.size(); i++) {
+				struct histogram &hist = events[i];
+				if (!hist.samples)
+					continue;
+				printf("%s\"%s\": {\"count\": %lu, \"p50\": %.0f, \"p99\": %.0f, \"p999\": %.0f, \"max\": %.0f}",
+					sep, timed_event_name[i], hist.samples, hist.percentile(0.5) / cycles_per_ns,
+					hist.percentile(0.99) / cycles_per_ns, hist.percentile(0.999) / cycles_per_ns,
+					hist.max / cycles_per_ns);
+				sep = ", ";
+			}
+			printf("}");
+		}
+		if (pmconfig.backend == pm_emulate)
+			printf(", \"pmem\": {\"latency_ns\": %u, \"bandwidth_mbs\": %u, \"lines\": %lu, \"streamed\": %lu, "
+				"\"fences\": %lu, \"stall_ns\": %lu}", pmconfig.latency_ns, pmconfig.bandwidth_mbs,
+				pmstats.lines, pmstats.streamed, pmstats.fences, pmstats.stall_ns);
+		printf(", \"tables\": [");
+		for (unsigned i = 0; i < tables.size(); i++)
+			printf("%s%s", i ? ", " : "", tables[i].c_str());
+		printf("]}\n");
+		return 0;
 	}
 
+	printf("workload %c, %s, %u records, %u threads, key %u value %u bytes (%s)\n",
+		spec.workload, dist, spec.records, spec.threads, spec.keysize, spec.valuesize,
+		pm_backend_name[pmconfig.backend]);
+	if (spec.cores)
+		printf("shared nothing, %u workers, %u requests in flight per client\n", spec.cores, spec.depth);
+	printf("load %u records in %.3f seconds, %.0f per second\n", spec.records, load, spec.records / load);
+	printf("run %u ops in %.3f seconds, %.0f per second\n", spec.ops, secs, spec.ops / secs);
+	for (unsigned op = 0; op < bench_ops; op++)
+		if (!latency[op].empty())
+			printf("%-6s %9lu ops, latency us p50 %.2f p99 %.2f p999 %.2f max %.2f\n",
+				bench_op_name[op], latency[op].size(), percentile(latency[op], 0.5) / 1e3,
+				percentile(latency[op], 0.99) / 1e3, percentile(latency[op], 0.999) / 1e3,
+				latency[op].back() / 1e3);
+	for (unsigned i = 0; i < events.size(); i++) {
+		struct histogram &hist = events[i];
+		if (hist.samples)
+			printf("%-12s %9lu events, latency us p50 %.2f p99 %.2f p999 %.2f max %.2f\n",
+				timed_event_name[i], hist.samples, hist.percentile(0.5) / cycles_per_ns / 1e3,
+				hist.percentile(0.99) / cycles_per_ns / 1e3, hist.percentile(0.999) / cycles_per_ns / 1e3,
+				hist.max / cycles_per_ns / 1e3);
+	}
+	if (missing)
+		printf("%lu lookups missed\n", missing);
+	emulation_report();
+	return 0;
+}
+
+/*
+ * Offline survey of a closed map file, mapped read only: media fifo length
+ * and tombstones by tier and optionally by shard, bucket chain lengths as
+ * populate would build them, record block fill and holes, bigmap slack.
+ */
+int inspect_run(const char *path, unsigned threads, bool json, bool verbose)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		error_exit(1, "could not open %s (%s)", path, strerror(errno));
+	struct superblock super;
+	int err = keymap::read_super(fd, super);
+	if (err)
+		error_exit(1, "%s is not a map file or is damaged (%s)", path, strerror(-err));
+
+	struct inspection survey;
+	double secs;
+	{
+		struct keymap map(super, fd, fixsize::recops);
+		struct timeval start, stop;
+		gettimeofday(&start, NULL);
+		map.inspect(survey, threads ? : std::thread::hardware_concurrency());
+		gettimeofday(&stop, NULL);
+		secs = (stop.tv_sec - start.tv_sec) + (stop.tv_usec - start.tv_usec) / 1e6;
+	}
+	close(fd);
+
+	const char *tier_name[] = {"upper", "lower"};
+	u64 blocksize = power2(super.header.blockbits), space = survey.blocks * blocksize;
+	u64 chained = survey.buckets - survey.chain[0], links = 0;
+	for (unsigned i = 1; i < inspection::chain_bins; i++)
+		links += i * survey.chain[i];
+	auto ratio = [](u64 a, u64 b) { return b ? (double)a / b : 0.0; };
+
+	if (json) {
+		printf("{\"path\": \"%s\", \"seconds\": %.3f, \"blocksize\": %lu, \"reclen\": %u, \"size\": %lu, "
+			"\"blocks\": %u, \"maxblocks\": %u, \"tiers\": {",
+			path, secs, blocksize, super.reclen, super.size, super.blocks, super.maxblocks);
+		for (unsigned tx = 0; tx < 2; tx++) {
+			struct inspection::fifos &fifos = survey.fifos[tx];
+			printf("%s\"%s\": {\"shards\": %lu, \"entries\": %lu, \"tombstones\": %lu, \"longest\": %lu, \"log2\": [",
+				tx ? ", " : "", tier_name[tx], fifos.shards, fifos.entries, fifos.tombstones, fifos.longest);
+			for (unsigned i = 0; i < inspection::fifo_bins; i++)
+				printf("%s%lu", i ? ", " : "", fifos.log2[i]);
+			printf("]");
+			if (verbose) {
+				printf(", \"shard\": [");
+				for (unsigned ix = 0; ix < survey.entries[tx].size(); ix++)
+					printf("%s[%u, %u]", ix ? ", " : "", survey.entries[tx][ix], survey.tombstones[tx][ix]);
+				printf("]");
+			}
+			printf("}");
+		}
+		printf("}, \"buckets\": %lu, \"chain\": [", survey.buckets);
+		for (unsigned i = 0; i < inspection::chain_bins; i++)
+			printf("%s%lu", i ? ", " : "", survey.chain[i]);
+		printf("], \"record_blocks\": %lu, \"map_blocks\": %lu, \"bad_blocks\": %lu, \"records\": %lu, "
+			"\"holes\": %lu, \"hole_bytes\": %lu, \"gap_bytes\": %lu, \"fill\": [",
+			survey.blocks, survey.maps, survey.bad, survey.records, survey.holes, survey.hole_bytes, survey.gap_bytes);
+		for (unsigned i = 0; i < inspection::fill_bins; i++)
+			printf("%s%lu", i ? ", " : "", survey.fill[i]);
+		printf("], \"bigmap_slack\": %lu}\n", survey.slack);
+		return 0;
+	}
+
+	printf("%s: %u blocks of %lu bytes, record %u bytes, mapped %lu bytes, surveyed in %.3f seconds\n",
+		path, super.blocks, blocksize, super.reclen, super.size, secs);
+	for (unsigned tx = 0; tx < 2; tx++) {
+		struct inspection::fifos &fifos = survey.fifos[tx];
+		if (tx && !fifos.shards)
+			continue;
+		printf("%s tier: %lu shards, %lu fifo entries, mean %.1f longest %lu, %lu tombstones (%.1f%%)\n",
+			tier_name[tx], fifos.shards, fifos.entries, ratio(fifos.entries, fifos.shards), fifos.longest,
+			fifos.tombstones, 100 * ratio(fifos.tombstones, fifos.entries));
+		printf("  fifo length up to 2^n:");
+		for (unsigned i = 0; i < inspection::fifo_bins; i++)
+			if (fifos.log2[i])
+				printf(" %u:%lu", i, fifos.log2[i]);
+		printf("\n");
+		if (verbose)
+			for (unsigned ix = 0; ix < survey.entries[tx].size(); ix++)
+				if (survey.entries[tx][ix])
+					printf("  shard %u: %u entries, %u tombstones\n",
+						ix, survey.entries[tx][ix], survey.tombstones[tx][ix]);
+	}
+	printf("buckets %lu, %.1f%% used, mean chain %.2f, by length:", survey.buckets,
+		100 * ratio(chained, survey.buckets), ratio(links, chained));
+	for (unsigned i = 0; i < inspection::chain_bins; i++)
+		if (survey.chain[i])
+			printf(" %u%s:%lu", i, i == inspection::chain_bins - 1 ? "+" : "", survey.chain[i]);
+	printf("\n");
+	printf("record blocks %lu, map blocks %lu, bad %lu, %lu records, %.1f%% used\n",
+		survey.blocks, survey.maps, survey.bad, survey.records,
+		100 * (1 - ratio(survey.gap_bytes + survey.hole_bytes, space)));
+	printf("  %lu holes of %lu bytes, free space %lu bytes, %.1f%% of it in holes\n",
+		survey.holes, survey.hole_bytes, survey.gap_bytes + survey.hole_bytes,
+		100 * ratio(survey.hole_bytes, survey.gap_bytes + survey.hole_bytes));
+	printf("  blocks by tenths full:");
+	for (unsigned i = 0; i < inspection::fill_bins; i++)
+		printf(" %lu", survey.fill[i]);
+	printf("\n");
+	printf("bigmap slack %lu\n", survey.slack);
 	return 0;
 }
@@ -0,0 +1,501 @@
+/*
+ * Shardmap hot kernel microbenchmarks
+ * (c) 2012 - 2019, Daniel Phillips
+ * License: GPL v3
+ *
+ * make micro && ./micro scratchfile
+ */
+
+extern "C" {
+#include <stdio.h>
+#include <stddef.h> // offsetof
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include "debug.h"
+}
+
+#include "shardmap.h"
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <functional>
+extern "C" {
+#include "options.h"
+#include "utility.h"
+#include "pmem.h"
+}
+
+#define trace trace_off
+
+/*
+ * Each kernel is timed in isolation over a number of runs after one warmup
+ * run, and reported as the median and minimum tsc cycles per operation, which
+ * hold steady from one invocation to the next where a mean would not. Run
+ * bodies return the cycles they spent in the kernel, so any work needed to
+ * restore state between operations stays out of the measurement.
+ */
+
+struct microspec
+{
+	unsigned runs = 5, scale = 1;
+	const char *only = "";
+	bool json = 0;
+};
+
+struct micro
+{
+	const struct microspec &spec;
+	std::string json; // one array, written out once all kernels have run
+	unsigned results = 0;
+	u64 randstate = 1;
+
+	micro(const struct microspec &spec) : spec(spec) {}
+
+	bool want(const char *group) { return strstr(group, spec.only) || strstr(spec.only, group); }
+
+	u64 random() // xorshift, repeatable across runs
+	{
+		randstate ^= randstate << 13;
+		randstate ^= randstate >> 7;
+		return randstate ^= randstate << 17;
+	}
+
+	void measure(const char *kernel, const std::string &what, unsigned ops, std::function<u64()> run)
+	{
+		if (!strstr(kernel, spec.only))
+			return;
+		std::vector<double> cycles;
+		run(); // warmup
+		for (unsigned i = 0; i < spec.runs; i++)
+			cycles.push_back((double)run() / ops);
+		std::sort(cycles.begin(), cycles.end());
+		double median = cycles[cycles.size() / 2], min = cycles[0];
+		if (spec.json) {
+			char line[300];
+			snprintf(line, sizeof line, "%s\n  {\"kernel\": \"%s\", \"case\": \"%s\", \"ops\": %u, \"runs\": %u, \"median\": %.2f, \"min\": %.2f}",
+				results ? "," : "[", kernel, what.c_str(), ops, spec.runs, median, min);
+			json += line;
+		} else {
+			printf("%-14s %-28s %10.2f cycles/op (min %.2f)\n", kernel, what.c_str(), median, min);
+			fflush(stdout);
+		}
+		results++;
+	}
+};
+
+static volatile u64 sink; // keep results live
+
+static struct header micro_header(unsigned blockbits)
+{
+	return (struct header){
+		.magic = {'t', 'e', 's', 't'},
+		.version = 0,
+		.blockbits = (u8)blockbits,
+		.tablebits = 9,
+		.maxtablebits = 19,
+		.reshard = 1,
+		.rehash = 2,
+		.loadfactor = one_fixed8,
+		.blocks = 0,
+
+		.upper = {
+			.mapbits = 0,
+			.stridebits = 23,
+			.locbits = 12,
+			.sigbits = 50},
+
+		.lower = {}
+	};
+}
+
+static void micro_keyhash(struct micro &m)
+{
+	enum {keys = 1024, stride = 256};
+	unsigned ops = 1000000 * m.spec.scale;
+	std::vector<u8> text(keys * stride);
+	for (auto &c: text)
+		c = m.random();
+
+	for (unsigned len: {1, 8, 16, 32, 64, 128, 255}) {
+		m.measure("keyhash", "len " + std::to_string(len), ops, [&]() {
+			u64 sum = 0, t = __rdtsc();
+			for (unsigned i = 0; i < ops; i++)
+				sum += keyhash(&text[(i % keys) * stride], len);
+			t = __rdtsc() - t;
+			sink = sum;
+			return t;
+		});
+	}
+}
+
+/*
+ * Lookup is timed as candidates, the hash chain walk of shard::lookup
+ * without the record block probe, which rb_lookup covers on its own.
+ * Inserts and removes move a batch of keys above the given load.
+ */
+static void micro_shard(struct micro &m)
+{
+	enum {tablebits = 16, buckets = 1 << tablebits, batch = buckets / 16};
+	struct header head = micro_header(14);
+	unsigned reps = std::max(1U, 16 * m.spec.scale);
+
+	for (unsigned load: {25, 50, 75, 100}) {
+		struct keymap sm{head, -1, fixsize::recops}; // deletes the shard
+		u64 sigmask = bitmask(sm.upper->sigbits);
+		loc_t locmask = bitmask(sm.upper->locbits) - 1;
+		unsigned fill = buckets * load / 100;
+		struct shard *shard = sm.map[0] = new struct shard(&sm, sm.upper, 0, tablebits, tablebits + 1);
+		std::vector<hashkey_t> keys(fill + batch);
+		for (auto &key: keys)
+			key = m.random() & sigmask;
+		for (unsigned i = 0; i < fill; i++)
+			shard->insert(keys[i], i & locmask);
+		std::string at = "load " + std::to_string(load) + "%";
+
+		auto moves = [&](bool insert) {
+			u64 t = 0;
+			for (unsigned rep = 0; rep < reps; rep++) {
+				if (!insert)
+					for (unsigned i = fill; i < fill + batch; i++)
+						shard->insert(keys[i], i & locmask);
+				u64 start = __rdtsc();
+				if (insert)
+					for (unsigned i = fill; i < fill + batch; i++)
+						shard->insert(keys[i], i & locmask);
+				else
+					for (unsigned i = fill; i < fill + batch; i++)
+						shard->remove(keys[i], i & locmask);
+				t += __rdtsc() - start;
+				if (insert)
+					for (unsigned i = fill; i < fill + batch; i++)
+						shard->remove(keys[i], i & locmask);
+			}
+			return t;
+		};
+
+		m.measure("shard", "insert " + at, reps * batch, [&]() { return moves(1); });
+		m.measure("shard", "lookup " + at, fill, [&]() {
+			std::vector<loc_t> locs;
+			u64 found = 0, t = __rdtsc();
+			for (unsigned i = 0; i < fill; i++) {
+				locs.clear();
+				shard->candidates(keys[i], locs);
+				found += locs.size();
+			}
+			t = __rdtsc() - t;
+			sink = found;
+			return t;
+		});
+		m.measure("shard", "remove " + at, reps * batch, [&]() { return moves(0); });
+	}
+}
+
+/*
+ * Record block images are built once per case, then copied back before
+ * each batch of creates or removes so every batch sees the same fill and
+ * hole density. Holes are every fourth record removed after filling.
+ */
+static void micro_rb(struct micro &m)
+{
+	enum {keylen = 16};
+	struct header head = micro_header(14);
+	struct keymap sm{head, -1, fixsize::recops};
+	unsigned blocksize = sm.blocksize, reclen = sm.bigmap::reclen;
+	u8 *block = (u8 *)aligned_alloc(linesize, blocksize);
+	struct recinfo ri = {blocksize, reclen, block, 0, &sm};
+	std::vector<u8> rec(reclen);
+
+	auto key = [](unsigned i, u8 *buf) {
+		memset(buf, 'k', keylen);
+		snprintf((char *)buf, keylen, "%x", i * 0x9e3779b1);
+	};
+	auto hash = [](u8 *key) { return (u16)keyhash(key, keylen); };
+
+	/* records of this key length that fit in an empty block */
+	fixsize::rb_init(&ri);
+	unsigned capacity = 0;
+	for (u8 name[keylen];; capacity++) {
+		key(capacity, name);
+		if (is_errcode(fixsize::rb_create(&ri, name, keylen, hash(name), rec.data())))
+			break;
+	}
+
+	for (auto shape: {std::make_pair(50, 0), std::make_pair(90, 0), std::make_pair(90, 25)}) {
+		unsigned fill = capacity * shape.first / 100, batch = std::max(1U, capacity / 20);
+		unsigned reps = std::max(1U, 100000 * m.spec.scale / fill);
+		std::vector<u8> names((fill + 2 * batch) * keylen);
+		for (unsigned i = 0; i < fill + 2 * batch; i++)
+			key(i, &names[i * keylen]);
+		auto name = [&](unsigned i) { return &names[i * keylen]; };
+		std::vector<unsigned> present;
+
+		fixsize::rb_init(&ri);
+		for (unsigned i = 0; i < fill; i++)
+			fixsize::rb_create(&ri, name(i), keylen, hash(name(i)), rec.data());
+		for (unsigned i = 0; i < fill; i++) {
+			if (shape.second && i % (100 / shape.second) == 0)
+				fixsize::rb_remove(&ri, name(i), keylen, hash(name(i)));
+			else
+				present.push_back(i);
+		}
+		std::vector<u8> image(block, block + blocksize), full;
+		for (unsigned i = fill; i < fill + batch; i++)
+			fixsize::rb_create(&ri, name(i), keylen, hash(name(i)), rec.data());
+		full.assign(block, block + blocksize);
+		memcpy(block, image.data(), blocksize);
+
+		std::string at = "fill " + std::to_string(shape.first) + "% holes " + std::to_string(shape.second) + "%";
+
+		m.measure("rb_create", at, reps * batch, [&]() {
+			u64 t = 0;
+			for (unsigned rep = 0; rep < reps; rep++) {
+				memcpy(block, image.data(), blocksize);
+				u64 start = __rdtsc();
+				for (unsigned i = fill; i < fill + batch; i++)
+					fixsize::rb_create(&ri, name(i), keylen, hash(name(i)), rec.data());
+				t += __rdtsc() - start;
+			}
+			return t;
+		});
+		memcpy(block, image.data(), blocksize);
+		m.measure("rb_lookup", "hit " + at, reps * present.size(), [&]() {
+			u64 found = 0, t = __rdtsc();
+			for (unsigned rep = 0; rep < reps; rep++)
+				for (unsigned i: present)
+					found += !!fixsize::rb_lookup(&ri, name(i), keylen, hash(name(i)));
+			t = __rdtsc() - t;
+			sink = found;
+			return t;
+		});
+		m.measure("rb_lookup", "miss " + at, reps * batch, [&]() {
+			u64 found = 0, t = __rdtsc();
+			for (unsigned rep = 0; rep < reps; rep++)
+				for (unsigned i = fill + batch; i < fill + 2 * batch; i++)
+					found += !!fixsize::rb_lookup(&ri, name(i), keylen, hash(name(i)));
+			t = __rdtsc() - t;
+			sink = found;
+			return t;
+		});
+		m.measure("rb_remove", at, reps * batch, [&]() {
+			u64 t = 0;
+			for (unsigned rep = 0; rep < reps; rep++) {
+				memcpy(block, full.data(), blocksize);
+				u64 start = __rdtsc();
+				for (unsigned i = fill; i < fill + batch; i++)
+					fixsize::rb_remove(&ri, name(i), keylen, hash(name(i)));
+				t += __rdtsc() - start;
+			}
+			return t;
+		});
+	}
+	free(block);
+}
+
+/*
+ * A small block size gives map levels at modest block counts. The map is
+ * grown with every block full, then each run frees a scattered batch of
+ * record blocks and searches them out again, timing one side or the other.
+ */
+static void micro_bigmap(struct micro &m, const char *path)
+{
+	enum {blockbits = 9, batch = 64, keylen = 16};
+	unsigned reps = std::max(1U, 1000 * m.spec.scale);
+
+	for (unsigned target: {256, 65536, 524288}) {
+		int fd = open(path, O_CREAT|O_RDWR|O_TRUNC, 0644);
+		if (fd < 0)
+			error_exit(1, "could not create %s (%s)", path, strerror(errno));
+		struct header head = micro_header(blockbits);
+		struct keymap *sm = new struct keymap(head, fd, fixsize::recops);
+		while (sm->blocks < target)
+			bigmap_try(sm, 1, 0);
+
+		std::vector<loc_t> locs;
+		while (locs.size() < reps * batch) {
+			loc_t loc = m.random() % sm->blocks;
+			if (!is_maploc(loc, blockbits))
+				locs.push_back(loc);
+		}
+
+		auto cycle = [&](bool timefree) {
+			u64 t = 0;
+			for (unsigned rep = 0; rep < reps; rep++) {
+				loc_t *at = &locs[rep * batch];
+				u64 start = __rdtsc();
+				for (unsigned i = 0; i < batch; i++)
+					bigmap_free(sm, at[i], maxname);
+				if (timefree)
+					t += __rdtsc() - start;
+				start = __rdtsc();
+				for (unsigned i = 0; i < batch; i++)
+					bigmap_try(sm, keylen, 0);
+				if (!timefree)
+					t += __rdtsc() - start;
+			}
+			return t;
+		};
+
+		std::string at = "levels " + std::to_string(sm->levels) + " blocks " + std::to_string(sm->blocks);
+		m.measure("bigmap_free", at, reps * batch, [&]() { return cycle(1); });
+		m.measure("bigmap_try", at, reps * batch, [&]() { return cycle(0); });
+		delete sm;
+		close(fd);
+	}
+	unlink(path);
+}
+
+static void micro_log(struct micro &m)
+{
+	unsigned logorder = logorder_default, entries = power2(logorder);
+	unsigned ops = 1000000 * m.spec.scale;
+	struct pmblock *log = (struct pmblock *)aligned_alloc(linesize, entries * sizeof *log), block = {};
+	std::vector<u8> data(sizeof(struct pmblock));
+	for (auto &c: data)
+		c = m.random();
+	log_clear(log, entries);
+
+	for (unsigned len: {8U, 64U, (unsigned)(sizeof(struct pmblock) - cellsize)}) {
+		m.measure("log_commit", "len " + std::to_string(len), ops, [&]() {
+			unsigned tail = 0;
+			u64 t = __rdtsc();
+			for (unsigned i = 0; i < ops; i++)
+				log_commit(log, logorder, data.data(), len, &tail);
+			return __rdtsc() - t;
+		});
+	}
+	m.measure("log_read", "block", ops, [&]() {
+		u64 sum = 0, t = __rdtsc();
+		for (unsigned i = 0; i < ops; i++) {
+			log_read(&block, log, i & (entries - 1));
+			sum += block.data[0];
+		}
+		t = __rdtsc() - t;
+		sink = sum;
+		return t;
+	});
+	free(log);
+}
+
+static void micro_pmwrite(struct micro &m)
+{
+	enum {span = 1 << 22};
+	u8 *to = (u8 *)aligned_alloc(linesize, span), *from = (u8 *)aligned_alloc(linesize, span);
+	memset(to, 0, span);
+	memset(from, 0x5a, span);
+
+	for (unsigned len: {64, 256, 4096, 16384}) {
+		unsigned ops = (256 << 20) / len * m.spec.scale / 4;
+		m.measure("pmwrite", "len " + std::to_string(len), ops, [&]() {
+			u64 t = __rdtsc();
+			for (unsigned i = 0, at = 0; i < ops; i++, at = (at + len) & (span - 1))
+				pmwrite(to + at, from + at, len);
+			sfence();
+			return __rdtsc() - t;
+		});
+	}
+	free(to);
+	free(from);
+}
+
+int main(int argc, const char *argv[])
+{
+	struct option options[] = {
+		{"kernel", "k", OPT_HASARG, "Only kernels with names containing this", ""},
+		{"runs", "r", OPT_HASARG|OPT_NUMBER, "Timed runs per case, median reported", "5"},
+		{"scale", "s", OPT_HASARG|OPT_NUMBER, "Multiply operations per run", "1"},
+		{"durability", "d", OPT_HASARG, "Durability backend (volatile, pmem, pagecache, emulate[:ns[:MB/s]])", "volatile"},
+		{"json", "j", 0, "Report as json"},
+		{"help", "?", 0, "Show help"},
+		{}};
+
+	char optv[1000];
+	int optc = optscan(options, &argc, (const char ***)&argv, optv, sizeof(optv));
+	if (optc < 0) {
+		printf("%s!\n", opterror(optv));
+		exit(1);
+	}
+
+	struct microspec spec = {};
+	int backend = pm_volatile;
+
+	for (int i = 0; i < optc; i++) {
+		struct option *option = options + optindex(optv, i);
+		switch (option->terse[0]) {
+		case 'k':
+			spec.only = optvalue(optv, i);
+			break;
+		case 'r':
+			spec.runs = atoi(optvalue(optv, i));
+			break;
+		case 's':
+			spec.scale = atoi(optvalue(optv, i));
+			break;
+		case 'd':
+			backend = pm_backend_parse(optvalue(optv, i));
+			if (backend < 0)
+				error_exit(1, "unknown durability backend '%s'", optvalue(optv, i));
+			break;
+		case 'j':
+			spec.json = 1;
+			break;
+		case '?': {
+			char help[3000];
+			int tabs[] = {3, 40, 100};
+			opthelp(help, sizeof(help), options, tabs, (char *)"Usage: micro <scratchfile> [OPTIONS]", 0);
+			printf("%s\n", help);
+			exit(0);
+		}
+		}
+	}
+
+	if (argc <= 1)
+		error_exit(1, "Usage: %s <scratchfile> [OPTIONS]", argv[0]);
+	if (!spec.runs || !spec.scale)
+		error_exit(1, "runs and scale must be at least one");
+
+	/* stay on one cpu so cycle counts are comparable */
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(sched_getcpu(), &cpus);
+	sched_setaffinity(0, sizeof cpus, &cpus);
+
+	/*
+	 * Table setup prints layout details to stdout. For json, send stdout
+	 * to stderr and keep the original for the report alone, so it pipes
+	 * cleanly into a json parser.
+	 */
+	FILE *out = stdout;
+	if (spec.json) {
+		fflush(stdout);
+		int fd = dup(1);
+		if (fd < 0 || !(out = fdopen(fd, "w")) || dup2(2, 1) < 0)
+			error_exit(1, "could not redirect stdout (%s)", strerror(errno));
+	}
+
+	pmem_setup((enum pm_backend)backend);
+	if (!spec.json)
+		printf("durability %s flush %s, tsc cycles, median of %u runs\n",
+			pm_backend_name[pmconfig.backend], pm_flush_name[pmconfig.flush], spec.runs);
+
+	struct micro m{spec};
+	if (m.want("keyhash"))
+		micro_keyhash(m);
+	if (m.want("shard"))
+		micro_shard(m);
+	if (m.want("rb_"))
+		micro_rb(m);
+	if (m.want("bigmap"))
+		micro_bigmap(m, argv[1]);
+	if (m.want("log_"))
+		micro_log(m);
+	if (m.want("pmwrite"))
+		micro_pmwrite(m);
+	if (spec.json)
+		fprintf(out, "%s%s]\n", m.results ? m.json.c_str() : "[", m.results ? "\n" : "");
+	return 0;
+}
@@ -15,6 +15,8 @@
 #include <stdarg.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <x86intrin.h>
 #include "debug.h"
 
 typedef uint64_t u64;
@@ -27,18 +29,127 @@ typedef uint64_t cell_t;
 /* cache line and pmem characteristics (duplicated in shardmap.h */
 
 typedef uint64_t cell_t;
-enum {logorder = 9, logsize = 1 << logorder, logmask = logsize - 1};
+enum {logorder_default = 9};
 enum {cellshift = 3, cellsize = 1 << cellshift};
 enum {lineshift = 6, linesize = 1 << lineshift, linemask = linesize - 1, linecells = linesize >> cellshift};
 enum {blocklines = 4, blockcells = blocklines * linecells};
 struct pmblock { cell_t data[blockcells]; };
 
+#include <cpuid.h>
 #include "pmem.h"
 
 #define trace trace_off
 
 enum {debug = 0, verify = 0};
 
+/* Durability backend */
+
+struct pmconfig pmconfig = {pm_volatile, pm_noflush, 300, 2000}; // emulation roughly one optane dimm
+const char *pm_backend_name[] = {"volatile", "pmem", "pagecache", "emulate"};
+const char *pm_flush_name[] = {"none", "clflush", "clflushopt", "clwb"};
+
+/* Cheapest cache line write back the cpu supports, clflush is baseline */
+static enum pm_flush pm_detect_flush(void)
+{
+	unsigned eax, ebx, ecx, edx;
+	if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+		if (ebx & bit_CLWB)
+			return pm_clwb;
+		if (ebx & bit_CLFLUSHOPT)
+			return pm_clflushopt;
+	}
+	return pm_clflush;
+}
+
+/* Emulation */
+
+__thread struct pmqueue pmqueue;
+struct pmstats pmstats;
+static double tsc_per_ns = 1;
+
+static uint64_t pm_nanotime(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void pm_calibrate(void)
+{
+	uint64_t ns = pm_nanotime(), tsc = __rdtsc(), elapsed;
+	while ((elapsed = pm_nanotime() - ns) < 10000000)
+		;
+	tsc_per_ns = (double)(__rdtsc() - tsc) / elapsed;
+}
+
+/*
+ * Charge a fence for the writes this thread queued since its last one. The
+ * emulated device is shared: each fence reserves transfer time for its
+ * bytes at the emulated bandwidth after whatever other threads reserved
+ * before it, then spins until its last line would have landed, a fixed
+ * write latency after the transfer. A fence with nothing queued costs
+ * nothing extra, as on hardware.
+ */
+static uint64_t pm_busy_until; // tsc at which all reserved transfers are done
+
+void pm_drain(void)
+{
+	struct pmqueue *queue = &pmqueue;
+	if (!queue->bytes)
+		return;
+	uint64_t start = __rdtsc(), done = start;
+	if (pmconfig.bandwidth_mbs) {
+		uint64_t transfer = queue->bytes * 1000 / pmconfig.bandwidth_mbs * tsc_per_ns;
+		uint64_t busy = __atomic_load_n(&pm_busy_until, __ATOMIC_RELAXED);
+		do
+			done = (busy > start ? busy : start) + transfer;
+		while (!__atomic_compare_exchange_n(&pm_busy_until, &busy, done, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	}
+	uint64_t until = done + pmconfig.latency_ns * tsc_per_ns;
+	while (__rdtsc() < until)
+		_mm_pause();
+	__atomic_add_fetch(&pmstats.lines, queue->lines, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&pmstats.streamed, queue->streamed, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&pmstats.fences, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&pmstats.stall_ns, (uint64_t)((until - start) / tsc_per_ns), __ATOMIC_RELAXED);
+	*queue = (struct pmqueue){};
+}
+
+int pmem_setup(enum pm_backend backend)
+{
+	pmconfig.backend = backend;
+	pmconfig.flush = backend == pm_pmem || backend == pm_emulate ? pm_detect_flush() : pm_noflush;
+	if (backend == pm_emulate)
+		pm_calibrate();
+	return 0;
+}
+
+/*
+ * Backend by name. Emulate takes optional write latency in nanoseconds and
+ * bandwidth in MB/s, as in emulate:300:2000, recorded in pmconfig here.
+ */
+int pm_backend_parse(const char *name)
+{
+	const char *args = strchr(name, ':');
+	unsigned len = args ? args - name : strlen(name);
+	for (int i = 0; i < sizeof pm_backend_name / sizeof *pm_backend_name; i++) {
+		if (len != strlen(pm_backend_name[i]) || strncmp(name, pm_backend_name[i], len))
+			continue;
+		if (args && i != pm_emulate)
+			return -EINVAL;
+		if (args) {
+			char *end;
+			pmconfig.latency_ns = strtoul(args + 1, &end, 10);
+			if (*end == ':')
+				pmconfig.bandwidth_mbs = strtoul(end + 1, &end, 10);
+			if (*end)
+				return -EINVAL;
+		}
+		return i;
+	}
+	return -EINVAL;
+}
+
 /* Persistent memory */
 
 void pmwrite(void *to, void *from, unsigned len)
@@ -62,10 +173,34 @@ void pmwrite(void *to, void *from, unsigned len)
 		hexdump(to, len);
 }
 
+/*
+ * Write only the cache lines of a line aligned buffer that differ from the
+ * persistent copy, in runs, returning bytes written. Reading back media is
+ * cheap compared to writing it.
+ */
+unsigned pmwrite_changed(void *to, void *from, unsigned len)
+{
+	unsigned written = 0;
+
+	for (unsigned at = 0, end; at < len; at = end) {
+		if (!memcmp(to + at, from + at, linesize)) {
+			end = at + linesize;
+			continue;
+		}
+		for (end = at + linesize; end < len && memcmp(to + end, from + end, linesize); end += linesize)
+			;
+		pmwrite(to + at, from + at, end - at);
+		written += end - at;
+	}
+	return written;
+}
+
 /* Microlog */
 
-void log_commit(struct pmblock log[logsize], void *data, unsigned len, unsigned *tail)
+/* Log is a ring of power2(logorder) entries, tail wraps within it */
+void log_commit(struct pmblock *log, unsigned logorder, void *data, unsigned len, unsigned *tail)
 {
+	unsigned logmask = (1 << logorder) - 1;
 	unsigned cells = (len + (-len & 7)) >> cellshift;
 	unsigned i = *tail, tag = (i >> logorder) & 3;
 
@@ -91,7 +226,7 @@ void log_commit(struct pmblock log[logsize], void *data, unsigned len, unsigned
 
 /* log replay */
 
-void log_read(struct pmblock *block, struct pmblock log[logsize], unsigned i)
+void log_read(struct pmblock *block, struct pmblock *log, unsigned i)
 {
 	cell_t *mem = log[i].data;
 	cell_t *ram = block->data;
@@ -102,7 +237,7 @@ void log_read(struct pmblock *block, struct pmblock log[logsize], unsigned i)
 	ram[blockcells - 1] = 0;
 }
 
-bool log_valid(struct pmblock log[logsize], unsigned i)
+bool log_valid(struct pmblock *log, unsigned i)
 {
 	unsigned sum = 0;
 
@@ -112,19 +247,19 @@ bool log_valid(struct pmblock log[logsize], unsigned i)
 	return !(sum % linecells);
 }
 
-bool log_less(struct pmblock log[logsize], unsigned i, unsigned j)
+bool log_less(struct pmblock *log, unsigned i, unsigned j)
 {
 	return ((log[i].data[0] - log[j].data[0]) & 3) < 0;
 }
 
-unsigned successor(unsigned i)
+unsigned successor(unsigned i, unsigned logorder)
 {
-	return (i + 1) & logmask;
+	return (i + 1) & ((1 << logorder) - 1);
 }
 
-void log_clear(struct pmblock log[logsize])
+void log_clear(struct pmblock *log, unsigned entries)
 {
-	for (int i = 0; i < logsize; i++) {
+	for (unsigned i = 0; i < entries; i++) {
 		memset(&log[i], 0, sizeof log[i]);
 		memset(&log[i], -1, 1);
 	}
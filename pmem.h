@@ -1,7 +1,36 @@
 #include <x86intrin.h>
 
-enum {noflush = 1, use_clwb = 0, use_intrinsics = 1, streaming = 1, verbose = 0};
-enum {microlog_size = logsize * sizeof (struct pmblock)};
+enum {use_intrinsics = 1, streaming = 1, verbose = 0};
+enum {microlog_size = (1 << logorder_default) * sizeof (struct pmblock)}; // default, one lane
+
+/*
+ * Durability backend, chosen once at startup by pmem_setup. Volatile does
+ * no flushing at all. Pmem writes back cache lines with the best flush
+ * instruction the cpu has and maps with MAP_SYNC where the file system is
+ * direct access. Pagecache relies on msync of the table at unify points,
+ * so updates are durable in groups rather than one by one. Emulate runs
+ * the pmem code paths on dram and charges persistent memory write costs,
+ * see pm_drain.
+ */
+enum pm_backend {pm_volatile, pm_pmem, pm_pagecache, pm_emulate};
+enum pm_flush {pm_noflush, pm_clflush, pm_clflushopt, pm_clwb};
+
+extern struct pmconfig {
+	enum pm_backend backend;
+	enum pm_flush flush;
+	unsigned latency_ns, bandwidth_mbs; // emulated write cost, zero bandwidth for unlimited
+} pmconfig;
+extern const char *pm_backend_name[], *pm_flush_name[];
+
+/* Emulated writes queued by this thread since its last fence */
+extern __thread struct pmqueue { uint64_t bytes, lines, streamed; } pmqueue;
+
+/* Emulation totals over all threads, updated at each fence */
+extern struct pmstats { uint64_t lines, streamed, fences, stall_ns; } pmstats;
+
+int pmem_setup(enum pm_backend backend);
+int pm_backend_parse(const char *name);
+void pm_drain(void);
 
 static void clflushopt(volatile void *p)
 {
@@ -10,24 +39,37 @@ static void clflushopt(volatile void *p)
 
 static void clwb(volatile void *p)
 {
-	if (noflush)
-		return;
 	if (verbose)
 		printf("clwb %p\n", p);
-	if (use_clwb) {
+	if (pmconfig.backend == pm_emulate) {
+		pmqueue.bytes += linesize;
+		pmqueue.lines++;
+	}
+	switch (pmconfig.flush) {
+	case pm_clwb:
 		asm volatile("clwb (%[pax])" // originally from kernel (gpl)
 			: [p] "+m" (*(volatile char *)p)
 			: [pax] "a" ((volatile char *)p));
-	} else
+		break;
+	case pm_clflushopt:
 		clflushopt(p);
+		break;
+	case pm_clflush:
+		asm volatile("clflush %P0" : "+m" (*(volatile char *)p));
+		break;
+	case pm_noflush:
+		break;
+	}
 }
 
 static void sfence(void)
 {
-	if (noflush)
+	if (pmconfig.backend != pm_pmem && pmconfig.backend != pm_emulate)
 		return;
 	if (verbose)
 		printf("sfence\n");
+	if (pmconfig.backend == pm_emulate)
+		pm_drain();
 	if (use_intrinsics)
 		_mm_sfence();
 	else
@@ -36,10 +78,15 @@ static void sfence(void)
 
 static void ntstore64(cell_t *to, cell_t value)
 {
+	if (pmconfig.backend == pm_emulate) {
+		pmqueue.bytes += cellsize;
+		pmqueue.streamed += cellsize;
+	}
 	_mm_stream_si64((long long int*)to, value);
 }
 
 void pmwrite(void *to, void *from, unsigned len);
-void log_clear(struct pmblock log[logsize]);
-void log_commit(struct pmblock log[logsize], void *data, unsigned len, unsigned *pgen);
-void log_read(struct pmblock *block, struct pmblock log[logsize], unsigned i);
+unsigned pmwrite_changed(void *to, void *from, unsigned len);
+void log_clear(struct pmblock *log, unsigned entries);
+void log_commit(struct pmblock *log, unsigned logorder, void *data, unsigned len, unsigned *pgen);
+void log_read(struct pmblock *block, struct pmblock *log, unsigned i);
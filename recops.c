@@ -153,6 +153,7 @@ rec_t *rb_lookup(struct recinfo *ri, const void *key, u8 len, u16 lowhash)
 		if (rb->table[i].hash == hash && keylen == len) {
 			if (!memcmp(key, rec + ri->reclen + varlen, keylen - varlen))
 				return rec + taglen;
+			ri->map->count(stat_tag_false);
 		}
 	}
 	return NULL;
@@ -372,3 +373,113 @@ int rb_walk(struct recinfo *ri, rb_walk_fn fn, void *context)
 	}
 	return 0;
 }
+
+/*
+ * Walk only records whose table hash code is in the 256 bit set codes, so a
+ * caller resolving a few known hashes avoids hashing every key in the block.
+ * Holes never match because holecode is not a record hash code.
+ */
+int rb_select(struct recinfo *ri, const u64 *codes, rb_walk_fn fn, void *context)
+{
+	rec_t *rec;
+	struct rb *rb = rbirec(ri, &rec);
+
+	for (unsigned i = 0; i < rb->count; i++) {
+		unsigned keylen = rb->table[i].len, code = rb->table[i].hash;
+		rec -= ri->reclen + keylen;
+		unsigned varlen = taglen ? rec[0] : 0;
+		if (codes[code >> 6] & power2(code & 63))
+			fn(context, rec + ri->reclen + varlen, keylen - varlen, rec + taglen, ri->reclen - taglen + varlen);
+	}
+	return 0;
+}
+
+static bool rb_where(const struct scanspec *spec, s64 field)
+{
+	switch (spec->where) {
+	case scanspec::eq: return field == spec->value;
+	case scanspec::ne: return field != spec->value;
+	case scanspec::lt: return field < spec->value;
+	case scanspec::le: return field <= spec->value;
+	case scanspec::gt: return field > spec->value;
+	case scanspec::ge: return field >= spec->value;
+	default: return 1;
+	}
+}
+
+/*
+ * Aggregate one block in a tight loop, the per record cost being a field load
+ * and compare, not an indirect call as for rb_walk. Fields may be unaligned
+ * so load them with memcpy, which compiles to a plain load on x86. Field
+ * offsets are trusted here, keymap::scan checks them against reclen.
+ */
+int rb_scan(struct recinfo *ri, const struct scanspec *spec, struct scansum *sum)
+{
+	rec_t *rec;
+	struct rb *rb = rbirec(ri, &rec);
+	bool all = spec->where == scanspec::all;
+
+	for (unsigned i = 0; i < rb->count; i++) {
+		unsigned keylen = rb->table[i].len;
+		rec -= ri->reclen + keylen;
+		if (rb->table[i].hash == holecode)
+			continue;
+		s64 field;
+		sum->records++;
+		if (!all) {
+			memcpy(&field, rec + taglen + spec->where_at, sizeof field);
+			if (!rb_where(spec, field))
+				continue;
+		}
+		memcpy(&field, rec + taglen + spec->sum_at, sizeof field);
+		sum->matched++;
+		sum->sum += field;
+		if (sum->min > field)
+			sum->min = field;
+		if (sum->max < field)
+			sum->max = field;
+	}
+	return 0;
+}
+
+/* Space held by holes: entry header, record and key text of each */
+int rb_waste(struct recinfo *ri)
+{
+	struct rb *rb = rbi(ri);
+	return rb->holes * (tabent_size + ri->reclen) + rb->free;
+}
+
+/*
+ * Squeeze all holes out of a block. Live records keep their table order and
+ * move up towards the top of the block, so each move is to a higher address
+ * than any record not yet moved and memmove in table order is safe. Records
+ * move, so any record pointers into the block are invalidated. Returns bytes
+ * reclaimed.
+ */
+int rb_compact(struct recinfo *ri)
+{
+	rec_t *rec;
+	struct rb *rb = rbirec(ri, &rec);
+	rec_t *top = rec;
+	unsigned count = 0, reclaimed = 0;
+
+	for (unsigned i = 0; i < rb->count; i++) {
+		unsigned size = ri->reclen + rb->table[i].len;
+		rec -= size;
+		if (rb->table[i].hash == holecode) {
+			reclaimed += size;
+			continue;
+		}
+		top -= size;
+		if (top != rec)
+			memmove(top, rec, size);
+		rb->table[count++] = rb->table[i];
+	}
+
+	trace("compact %u entries to %u, reclaim %u", rb->count, count, reclaimed);
+	rb->used -= reclaimed;
+	reclaimed += (rb->count - count) * tabent_size;
+	rb->count = count;
+	rb->holes = rb->free = 0;
+	return reclaimed;
+}
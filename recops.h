@@ -30,6 +30,10 @@ struct recops {
 	rec_t *(*create)(struct recinfo *ri, const void *newkey, u8 newlen, u16 lowhash, const void *newrec, u8 varlen);
 	int (*remove)(struct recinfo *ri, const void *key, u8 len, u16 lowhash);
 	int (*walk)(struct recinfo *ri, rb_walk_fn fn, void *context);
+	int (*select)(struct recinfo *ri, const u64 *codes, rb_walk_fn fn, void *context);
+	int (*scan)(struct recinfo *ri, const struct scanspec *spec, struct scansum *sum);
+	int (*waste)(struct recinfo *ri);
+	int (*compact)(struct recinfo *ri);
 };
 
 namespace fixsize {
@@ -48,5 +52,9 @@ namespace fixsize {
 	rec_t *rb_create(struct recinfo *ri, const void *newkey, u8 newlen, u16 lowhash, const void *newrec, u8 varlen = 0);
 	int rb_remove(struct recinfo *ri, const void *key, u8 len, u16 lowhash);
 	int rb_walk(struct recinfo *ri, rb_walk_fn fn, void *context);
+	int rb_select(struct recinfo *ri, const u64 *codes, rb_walk_fn fn, void *context);
+	int rb_scan(struct recinfo *ri, const struct scanspec *spec, struct scansum *sum);
+	int rb_waste(struct recinfo *ri);
+	int rb_compact(struct recinfo *ri);
 	extern struct recops recops;
 }
@@ -12,6 +12,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <errno.h>
 
 #include "shardmap.h"
@@ -20,6 +21,7 @@ extern "C" {
 #include "debug.h"
 #include "utility.h"
 #include "pmem.h"
+#include "uring.h"
 }
 
 #define warn trace_on
@@ -47,6 +49,10 @@ namespace fixsize {
 		.create = rb_create,
 		.remove = rb_remove,
 		.walk = rb_walk,
+		.select = rb_select,
+		.scan = rb_scan,
+		.waste = rb_waste,
+		.compact = rb_compact,
 	};
 }
 
@@ -79,6 +85,16 @@ enum {split_order = 0, totalentries_order = 26};
 #include <algorithm> // min
 #include <utility> // swap
 #include <string>
+#include <thread> // parallel scan
+#include <mutex> // table allocator
+#include <condition_variable> // background unify
+#include <deque> // maintenance queues
+#include <unordered_map> // block pool
+#include <unordered_set>
+#include <atomic>
+#include <sched.h> // numa worker affinity
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 
 /* Variable width field packing */
 
@@ -114,13 +130,761 @@ struct sidelog
 	u8 rx; // relative tier index
 	u8 flags;
 	u8 unused;
+	enum {flattened = 1}; // flags: shard fifo rewritten since logged
 };
-
-enum {sidelog_size = logsize * sizeof(struct sidelog)};
 #endif
 
+/*
+ * Background maintenance pool, shared by all keymaps. A task is queued on
+ * the home worker of the thread that submits it; owners take their newest
+ * task and idle workers steal the oldest from others. Tasks are cpu bound,
+ * as the parts of a large reshard split are, or io bound, as unify batches
+ * are. A split queues all its parts on one home worker, so stealing is what
+ * spreads them over the pool. Each kind has a budget of workers it may hold
+ * at once, by default leaving one worker that cpu work cannot take so unify
+ * is never stuck behind a large reshard. A foreground caller that needs a
+ * task done claims it if no worker has started it and runs it itself.
+ */
+static unsigned thread_index();
+
+struct maintask
+{
+	enum {idle, queued, running, done};
+	std::function<void()> fn;
+	u8 kind;
+	std::atomic<u8> state{idle};
+};
+
+static struct maintconfig { unsigned workers, budget[maint_kinds]; } maintconfig;
+
+struct maintpool
+{
+	struct queues
+	{
+		std::mutex lock;
+		std::deque<struct maintask *> queue;
+	};
+
+	std::vector<struct queues *> workers;
+	std::vector<std::thread> threads;
+	std::mutex lock;
+	std::condition_variable wake, finished;
+	u64 events = 0; // submits and finishes, under lock, so idle workers never miss one
+	bool stopping = 0;
+	std::atomic<unsigned> running[maint_kinds]{};
+	std::atomic<u64> tasks{0}, stolen{0}, helped{0}, waited{0};
+	std::atomic<u64> ran[maint_kinds]{}; // by workers or helpers
+
+	maintpool()
+	{
+		unsigned n = maintconfig.workers;
+		for (unsigned i = 0; i < n; i++)
+			workers.push_back(new struct queues);
+		for (unsigned i = 0; i < n; i++)
+			threads.emplace_back([this, i]() { run(i); });
+	}
+
+	/* Workers finish every task still queued before they exit */
+	~maintpool()
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = 1;
+			wake.notify_all();
+		}
+		for (std::thread &thread: threads)
+			thread.join();
+		for (struct queues *queues: workers)
+			delete queues;
+	}
+
+	void submit(struct maintask &task)
+	{
+		struct queues &home = *workers[thread_index() % workers.size()];
+		task.state = maintask::queued;
+		{
+			std::lock_guard<std::mutex> guard(home.lock);
+			home.queue.push_back(&task);
+		}
+		std::lock_guard<std::mutex> guard(lock);
+		events++;
+		wake.notify_one();
+	}
+
+	bool reserve(unsigned kind)
+	{
+		unsigned now = running[kind];
+		do {
+			if (now >= maintconfig.budget[kind])
+				return 0;
+		} while (!running[kind].compare_exchange_weak(now, now + 1));
+		return 1;
+	}
+
+	static bool claim(struct maintask &task)
+	{
+		u8 expect = maintask::queued;
+		return task.state.compare_exchange_strong(expect, maintask::running);
+	}
+
+	void finish(struct maintask &task)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		task.state = maintask::done;
+		events++;
+		finished.notify_all();
+		wake.notify_all(); // budget released
+	}
+
+	/*
+	 * Next task within budget, own queue from the back, others from the
+	 * front. Entries already claimed by a helper are dropped on the way.
+	 */
+	struct maintask *take(unsigned self)
+	{
+		unsigned n = workers.size();
+		for (unsigned k = 0; k < n; k++) {
+			struct queues &from = *workers[(self + k) % n];
+			std::lock_guard<std::mutex> guard(from.lock);
+			std::deque<struct maintask *> &queue = from.queue;
+			while (!queue.empty()) {
+				struct maintask *task = k ? queue.front() : queue.back();
+				if (task->state != maintask::queued) {
+					k ? queue.pop_front() : queue.pop_back();
+					continue;
+				}
+				if (!reserve(task->kind))
+					break;
+				k ? queue.pop_front() : queue.pop_back();
+				if (claim(*task)) {
+					stolen += !!k;
+					return task;
+				}
+				running[task->kind]--;
+			}
+		}
+		return NULL;
+	}
+
+	void run(unsigned self)
+	{
+		while (1) {
+			u64 seen;
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				seen = events;
+			}
+			struct maintask *task = take(self);
+			if (!task) {
+				std::unique_lock<std::mutex> guard(lock);
+				if (stopping && events == seen)
+					return;
+				wake.wait(guard, [this, seen]() { return stopping || events != seen; });
+				continue;
+			}
+			task->fn();
+			tasks++;
+			ran[task->kind]++;
+			running[task->kind]--;
+			finish(*task);
+		}
+	}
+
+	/* Wait for a task, running it here if no worker has taken it yet */
+	bool wait(struct maintask &task)
+	{
+		if (task.state == maintask::idle || task.state == maintask::done)
+			return 0;
+		if (claim(task)) {
+			task.fn();
+			helped++;
+			ran[task.kind]++;
+			finish(task);
+			return 1;
+		}
+		std::unique_lock<std::mutex> guard(lock);
+		finished.wait(guard, [&task]() { return task.state == maintask::done; });
+		waited++;
+		return 1;
+	}
+
+	/*
+	 * Run fn for each index below n as tasks of one kind and return once
+	 * all are done, the caller running any not yet taken.
+	 */
+	void parallel(unsigned n, std::function<void(unsigned)> fn, u8 kind = maint_cpu)
+	{
+		struct maintask *tasks = new struct maintask[n];
+		for (unsigned i = 0; i < n; i++) {
+			tasks[i].fn = [&fn, i]() { fn(i); };
+			tasks[i].kind = kind;
+			submit(tasks[i]);
+		}
+		for (unsigned i = 0; i < n; i++)
+			forget(tasks[i]);
+		delete[] tasks;
+	}
+
+	/* Drop any queue entries of a task about to be destroyed, once done */
+	void forget(struct maintask &task)
+	{
+		wait(task);
+		for (struct queues *queues: workers) {
+			std::lock_guard<std::mutex> guard(queues->lock);
+			std::deque<struct maintask *> &queue = queues->queue;
+			for (auto it = queue.begin(); it != queue.end();)
+				it = *it == &task ? queue.erase(it) : it + 1;
+		}
+	}
+};
+
+static struct maintpool *maintpool;
+static std::mutex maintlock; // pool creation and shutdown
+
+static void maint_config(unsigned workers, unsigned cpu_budget, unsigned io_budget)
+{
+	workers = workers ? : std::max(std::thread::hardware_concurrency(), 1U);
+	maintconfig.workers = workers;
+	maintconfig.budget[maint_cpu] = cpu_budget ? : std::max(workers - 1, 1U);
+	maintconfig.budget[maint_io] = io_budget ? : workers;
+}
+
+/* Size the maintenance pool, only before its first use */
+int maint_setup(unsigned workers, unsigned cpu_budget, unsigned io_budget)
+{
+	std::lock_guard<std::mutex> guard(maintlock);
+	if (maintpool)
+		return -EBUSY;
+	maint_config(workers, cpu_budget, io_budget);
+	return 0;
+}
+
+static struct maintpool &maint()
+{
+	struct maintpool *pool = __atomic_load_n(&maintpool, __ATOMIC_ACQUIRE);
+	if (pool)
+		return *pool;
+	std::lock_guard<std::mutex> guard(maintlock);
+	if (!maintpool) {
+		if (!maintconfig.workers)
+			maint_config(0, 0, 0);
+		__atomic_store_n(&maintpool, new struct maintpool, __ATOMIC_RELEASE);
+	}
+	return *maintpool;
+}
+
+/*
+ * Finish queued tasks and join the workers, after the last keymap using
+ * the pool is gone. A later use starts a new pool, sized as before.
+ */
+void maint_shutdown()
+{
+	std::lock_guard<std::mutex> guard(maintlock);
+	delete maintpool;
+	__atomic_store_n(&maintpool, (struct maintpool *)NULL, __ATOMIC_RELEASE);
+}
+
+struct maintstats maint_stats()
+{
+	std::lock_guard<std::mutex> guard(maintlock);
+	if (!maintpool)
+		return {};
+	return {maintpool->tasks, maintpool->stolen, maintpool->helped, maintpool->waited,
+		{maintpool->ran[maint_cpu], maintpool->ran[maint_io]}};
+}
+
+/* Background unify, see unify_begin */
+
+struct flusher
+{
+	struct keymap *const map;
+	struct maintask task;
+	unsigned batches = 0, stalls = 0;
+
+	/* sealed batch, owned by the flusher task while queued or running */
+	std::vector<std::pair<unsigned, unsigned>> spans; // per lane entries to unify, unify entry at end
+	loc_t loc; // sink block
+	u8 *block; // sink block snapshot
+	std::vector<struct countline> counts;
+	std::vector<std::pair<loc_t, unsigned>> frames; // dirty pool frames
+
+	flusher(struct keymap *map) :
+		map(map), block((u8 *)aligned_alloc(PAGE_SIZE, map->blocksize)) // written with O_DIRECT
+	{
+		task.fn = [this]() { this->map->unify_batch(*this); };
+		task.kind = maint_io;
+	}
+
+	~flusher()
+	{
+		if (map->background_unify)
+			maint().forget(task);
+		free(block);
+	}
+};
+
+/*
+ * Record block pool, an alternative to reaching record blocks through the
+ * file map, for tables much larger than memory. A fixed set of block frames
+ * is filled by pread and written back by pwrite, optionally with O_DIRECT,
+ * replaced in clock order. Frames handed out by ext_bigmap_mem stay pinned
+ * until recent_pins later blocks have been handed out, by any caller, so a
+ * record pointer returned by lookup survives only its immediate use unless
+ * the caller pins it with keymap::pin until done with it. Changed frames
+ * are written back by unify, or on replacement.
+ */
+struct blockpool
+{
+	enum {recent_pins = 8, ring_entries = 256};
+	enum : loc_t {noloc = ~0U};
+
+	struct frame { loc_t loc; u32 pins; u8 ref, dirty; };
+
+	const int fd;
+	const loff_t base; // file position of block zero
+	const unsigned blockbits, frames;
+	u8 *arena;
+	std::vector<struct frame> frame;
+	std::unordered_map<loc_t, unsigned> where;
+	std::vector<unsigned> dirty; // frames marked dirty since last unify
+	std::unordered_set<loc_t> writing; // blocks unify is writing back
+	std::condition_variable written;
+	unsigned hand = 0, recent[recent_pins], recent_at = 0;
+	std::mutex lock;
+	u64 hits = 0, misses = 0;
+	std::atomic<u64> reads{0}, writes{0}; // also counted by unify without the lock
+	struct uring ring, flush_ring; // batched reads under lock, unify writes
+	bool async;
+
+	blockpool(int fd, loff_t base, unsigned blockbits, unsigned frames) :
+		fd(fd), base(base), blockbits(blockbits), frames(frames),
+		arena((u8 *)aligned_alloc(PAGE_SIZE, power2(blockbits, frames))),
+		frame(frames, {noloc, 0, 0, 0})
+	{
+		for (unsigned i = 0; i < recent_pins; i++)
+			frame[recent[i] = i].pins++; // placeholders, released as the ring turns
+		int err = uring_open(&ring, ring_entries);
+		if (!err && (err = uring_open(&flush_ring, ring_entries)))
+			uring_close(&ring);
+		if ((async = !err))
+			trace("block pool uses io_uring");
+		else
+			trace("no io_uring (%s), block pool uses pread and pwrite", strerror(-err));
+	}
+
+	~blockpool()
+	{
+		if (async) {
+			uring_close(&ring);
+			uring_close(&flush_ring);
+		}
+		if (fd >= 0)
+			close(fd);
+		free(arena);
+	}
+
+	u8 *data(unsigned i) { return arena + power2(blockbits, i); }
+	unsigned index(const void *mem) { return ((const u8 *)mem - arena) >> blockbits; }
+	bool owns(const void *mem) { return mem >= arena && mem < arena + power2(blockbits, frames); }
+
+	void io(bool write, loc_t loc, u8 *buf, unsigned blocks = 1)
+	{
+		size_t len = power2(blockbits, blocks);
+		ssize_t done = write ? pwrite(fd, buf, len, pos(loc)) : pread(fd, buf, len, pos(loc));
+		if (done != (ssize_t)len)
+			error_exit(1, "block %u %s failed (%s)", loc, write ? "write" : "read", done < 0 ? strerror(errno) : "short");
+		(write ? writes : reads) += blocks;
+	}
+
+	loff_t pos(loc_t loc) { return base + power2(blockbits, loc); }
+
+	/* Submit a ring full of queued transfers and wait for all of them */
+	void run(struct uring *ring)
+	{
+		int err = uring_run(ring);
+		if (err)
+			error_exit(1, "block pool io failed (%s)", strerror(-err));
+	}
+
+	/*
+	 * Read blocks into a contiguous buffer as a batch of extents of at most
+	 * per blocks each, so the device sees them all at once.
+	 */
+	void read_extents(struct uring *ring, loc_t loc, u8 *buf, unsigned blocks, unsigned per)
+	{
+		if (!ring) {
+			io(0, loc, buf, blocks);
+			return;
+		}
+		for (unsigned at = 0; at < blocks; at += per) {
+			unsigned n = std::min(blocks - at, per);
+			u8 *to = buf + power2(blockbits, at);
+			if (uring_read(ring, fd, to, power2(blockbits, n), pos(loc + at))) {
+				run(ring); // ring full
+				uring_read(ring, fd, to, power2(blockbits, n), pos(loc + at));
+			}
+		}
+		run(ring);
+		reads += blocks;
+	}
+
+	void detach(unsigned i)
+	{
+		where.erase(frame[i].loc);
+		frame[i].loc = noloc;
+		frame[i].dirty = 0;
+	}
+
+	/*
+	 * Clock replacement, skipping pinned frames, writing back a dirty victim.
+	 * If unify has the rest pinned for write back, wait for it, which drops
+	 * the lock.
+	 */
+	unsigned victim(std::unique_lock<std::mutex> &guard)
+	{
+		for (unsigned n = 2 * frames + 1; n; n--) {
+			if (n == 1 && !writing.empty()) {
+				written.wait(guard);
+				n = 2 * frames + 1;
+			}
+			unsigned i = hand;
+			hand = hand + 1 == frames ? 0 : hand + 1;
+			struct frame &f = frame[i];
+			if (f.pins)
+				continue;
+			if (f.ref) {
+				f.ref = 0;
+				continue;
+			}
+			if (f.loc != noloc) {
+				if (f.dirty)
+					io(1, f.loc, data(i));
+				detach(i);
+			}
+			return i;
+		}
+		error_exit(1, "block pool exhausted, all %u frames pinned", frames);
+		return 0;
+	}
+
+	/* Pinned frame holding block, loaded if need be, caller holds lock */
+	unsigned get(std::unique_lock<std::mutex> &guard, loc_t loc)
+	{
+		auto found = where.find(loc);
+		unsigned i;
+		if (found != where.end()) {
+			i = found->second;
+			hits++;
+		} else {
+			i = victim(guard);
+			io(0, loc, data(i));
+			frame[i].loc = loc;
+			where[loc] = i;
+			misses++;
+		}
+		frame[i].ref = 1;
+		frame[i].pins++;
+		return i;
+	}
+
+	/*
+	 * A frame can be detached while unify writes it back, so media is
+	 * stale until the write lands.
+	 */
+	void wait_written(std::unique_lock<std::mutex> &guard, loc_t loc)
+	{
+		written.wait(guard, [this, loc]() { return !writing.count(loc); });
+	}
+
+	/* Pinned for the next few blocks handed out, see recent_pins */
+	u8 *get_recent(loc_t loc)
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		wait_written(guard, loc);
+		unsigned i = get(guard, loc);
+		frame[recent[recent_at]].pins--;
+		recent[recent_at] = i;
+		recent_at = (recent_at + 1) % recent_pins;
+		return data(i);
+	}
+
+	/* Pinned only if already resident, for scans that read around the pool */
+	u8 *get_resident(loc_t loc)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		auto found = where.find(loc);
+		if (found == where.end())
+			return NULL;
+		frame[found->second].pins++;
+		return data(found->second);
+	}
+
+	/*
+	 * Load blocks that are not yet resident with one batch of reads. Frames
+	 * are left unpinned, so the batch is capped at half the frames not
+	 * pinned as recent, to leave lookups something to find.
+	 */
+	void prefetch(std::vector<loc_t> &locs)
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		std::vector<unsigned> loaded;
+		unsigned most = std::min((unsigned)ring_entries, (frames - recent_pins) / 2);
+		std::sort(locs.begin(), locs.end());
+		locs.erase(std::unique(locs.begin(), locs.end()), locs.end());
+		for (loc_t loc: locs) {
+			if (loaded.size() == most)
+				break;
+			if (where.count(loc) || writing.count(loc))
+				continue;
+			unsigned i = victim(guard);
+			frame[i].pins++;
+			frame[i].loc = loc;
+			loaded.push_back(i);
+			if (async)
+				uring_read(&ring, fd, data(i), power2(blockbits), pos(loc));
+			else
+				io(0, loc, data(i));
+		}
+		if (async && loaded.size()) {
+			run(&ring);
+			reads += loaded.size();
+		}
+		for (unsigned i: loaded) {
+			where[frame[i].loc] = i;
+			frame[i].ref = 1;
+			frame[i].pins--;
+			misses++;
+		}
+	}
+
+	void pin(const void *mem)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		frame[index(mem)].pins++;
+	}
+
+	void put(const void *mem)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		assert(frame[index(mem)].pins);
+		frame[index(mem)].pins--;
+	}
+
+	void mark_frame(unsigned i)
+	{
+		if (!frame[i].dirty && frame[i].loc != noloc) {
+			frame[i].dirty = 1;
+			dirty.push_back(i);
+		}
+	}
+
+	void mark(loc_t loc)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		auto found = where.find(loc);
+		if (found != where.end())
+			mark_frame(found->second);
+	}
+
+	void mark_mem(const void *mem)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		mark_frame(index(mem));
+	}
+
+	/*
+	 * Block is becoming a front buffer, which owns it from now on. Write
+	 * back first if dirty, because a sink can be abandoned unwritten when
+	 * nothing was logged against it.
+	 */
+	void read(loc_t loc, u8 *buf)
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		wait_written(guard, loc);
+		auto found = where.find(loc);
+		if (found == where.end()) {
+			io(0, loc, buf);
+			return;
+		}
+		unsigned i = found->second;
+		if (frame[i].dirty)
+			io(1, loc, data(i));
+		memcpy(buf, data(i), power2(blockbits));
+		detach(i);
+	}
+
+	void write(loc_t loc, u8 *buf)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		auto found = where.find(loc);
+		if (found != where.end())
+			detach(found->second);
+		io(1, loc, buf);
+	}
+
+	/* Data only, metadata such as size is settled when the table grows */
+	void sync()
+	{
+		if (fdatasync(fd))
+			error_exit(1, "block pool sync failed (%s)", strerror(errno));
+	}
+
+	/* Hand dirty frames to unify, pinned until written */
+	void take_dirty(std::vector<std::pair<loc_t, unsigned>> &out)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		for (unsigned i: dirty) {
+			if (!frame[i].dirty)
+				continue;
+			frame[i].dirty = 0;
+			frame[i].pins++;
+			writing.insert(frame[i].loc);
+			out.push_back({frame[i].loc, i});
+		}
+		dirty.clear();
+	}
+
+	/*
+	 * Unify writes: the sink block if any plus frames taken dirty, all
+	 * submitted together, then one drained fsync as the barrier if the
+	 * backend is durable. Runs in the flusher task, which owns flush_ring.
+	 */
+	void write_back(std::vector<std::pair<loc_t, unsigned>> &taken, bool durable, loc_t sink = noloc, u8 *block = NULL)
+	{
+		if (sink != noloc) {
+			std::lock_guard<std::mutex> guard(lock);
+			auto found = where.find(sink);
+			if (found != where.end())
+				detach(found->second);
+		}
+		if (async) {
+			if (sink != noloc)
+				uring_write(&flush_ring, fd, block, power2(blockbits), pos(sink));
+			for (auto &which: taken) {
+				if (uring_write(&flush_ring, fd, data(which.second), power2(blockbits), pos(which.first))) {
+					run(&flush_ring);
+					uring_write(&flush_ring, fd, data(which.second), power2(blockbits), pos(which.first));
+				}
+			}
+			if (durable && uring_fsync(&flush_ring, fd)) {
+				run(&flush_ring);
+				uring_fsync(&flush_ring, fd);
+			}
+			run(&flush_ring);
+			writes += taken.size() + (sink != noloc);
+		} else {
+			if (sink != noloc)
+				io(1, sink, block);
+			for (auto &which: taken)
+				io(1, which.first, data(which.second));
+			if (durable)
+				sync();
+		}
+		std::lock_guard<std::mutex> guard(lock);
+		for (auto &which: taken) {
+			frame[which.second].pins--;
+			writing.erase(which.first);
+		}
+		written.notify_all();
+	}
+};
+
+/* Latency histograms */
+
+const char *timed_event_name[timed_events] = {
+	"lookup", "insert", "remove", "scan",
+	"create", "bigmap_try", "unify_begin", "unify_wait", "unify_batch",
+	"rehash", "reshard", "grow_map", "add_tier", "redo_maps",
+	"populate", "evict", "compact", "flatten"};
+
+const char *stat_counter_name[stat_counters] = {
+	"lookups", "hits", "misses", "inserts", "removes",
+	"buckets", "chain", "probes", "tag_false",
+	"unifies", "unify_bytes", "stalls",
+	"rehash", "reshard", "grow_map", "add_tier", "drop_tier",
+	"populate", "evict", "flatten", "compact", "merge",
+	"bigmap_try", "bigmap_scan"};
+
+unsigned histogram::bucket(u64 cycles)
+{
+	if (cycles < subbuckets)
+		return cycles;
+	unsigned shift = 63 - __builtin_clzll(cycles) - subbits;
+	return (shift + 1) * subbuckets + ((cycles >> shift) & (subbuckets - 1));
+}
+
+u64 histogram::lower(unsigned bucket)
+{
+	if (bucket < subbuckets)
+		return bucket;
+	unsigned shift = bucket / subbuckets - 1;
+	return (u64)(subbuckets + bucket % subbuckets) << shift;
+}
+
+void histogram::add(u64 cycles)
+{
+	count[bucket(cycles)]++;
+	samples++;
+	total += cycles;
+	max = std::max(max, cycles);
+}
+
+/* Smallest bucket bound with at least fraction of samples at or below it */
+u64 histogram::percentile(double fraction) const
+{
+	u64 want = samples * fraction, seen = 0;
+	for (unsigned i = 0; i < buckets; i++)
+		if ((seen += count[i]) > want)
+			return std::min(i + 1 < buckets ? lower(i + 1) - 1 : max, max);
+	return max;
+}
+
+/* Times a scope into one histogram, one load and branch if disabled */
+struct timed
+{
+	struct histogram *hist;
+	u64 start;
+
+	timed(struct timing *timing, enum timed_event what) :
+		hist(timing ? timing->event + what : NULL), start(hist ? __rdtsc() : 0) {}
+	~timed() { if (hist) hist->add(__rdtsc() - start); }
+};
+
 /* Memory layout setup */
 
+/*
+ * Advise on a range that need not be page aligned, best effort. Failure
+ * only means the hint is not supported for this mapping, for example
+ * hugepages for a page cache file.
+ */
+static void advise(void *mem, u64 size, int advice)
+{
+	uintptr_t start = (uintptr_t)mem & -(uintptr_t)PAGE_SIZE;
+	if (madvise((void *)start, align((uintptr_t)mem + size - start, PAGEBITS), advice))
+		trace("madvise %i failed (%s)", advice, strerror(errno));
+}
+
+/*
+ * Hugepage regions are aligned to 2 MB in file and address space so the
+ * whole region can be mapped by large pages, random regions get no
+ * readahead, and small hot regions are prefaulted so the first unify does
+ * not take a fault per page.
+ */
+static void region_policy(const struct region &region)
+{
+	if (region.policy & region::hugepage)
+		advise(*region.mem, region.size, MADV_HUGEPAGE);
+	if (region.policy & region::random)
+		advise(*region.mem, region.size, MADV_RANDOM);
+	if (region.policy & region::populate) {
+#ifdef MADV_POPULATE_WRITE
+		advise(*region.mem, region.size, MADV_POPULATE_WRITE);
+#else
+		advise(*region.mem, region.size, MADV_WILLNEED);
+#endif
+	}
+}
+
 void layout::do_maps(int fd)
 {
 	unsigned count = map.size();
@@ -141,13 +905,32 @@ void layout::do_maps(int fd)
 	if (verbose)
 		printf("*: %lx\n", size);
 
-	void *base;
-	if (single_map)
-		base = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (single_map) {
+		/* reserve address space to place the file map on a hugepage boundary */
+		enum {hugebits = 21};
+		u8 *area = (u8 *)mmap(NULL, size + power2(hugebits), PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+		if (area == MAP_FAILED)
+			errno_exit(1);
+		u8 *start = (u8 *)align((uintptr_t)area, hugebits);
+		base = mmap(start, size, PROT_READ|PROT_WRITE, share()|MAP_FIXED, fd, 0);
+		if (base == MAP_FAILED && share() != MAP_SHARED && errno == EOPNOTSUPP) {
+			static bool warned;
+			if (!warned)
+				warn("no MAP_SYNC, file system is not direct access");
+			warned = 1;
+			base = mmap(start, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, 0);
+		}
+		if (base == MAP_FAILED)
+			errno_exit(1);
+		if (start > area)
+			munmap(area, start - area);
+		munmap(start + size, area + power2(hugebits) - start);
+	}
 
 	pos = 0;
 	for (unsigned i = 0; i < count; pos += map[i++].size) {
 		if (map[i].size) {
+			pos = align(pos, map[i].align);
 			if (!map[i].mem)
 				continue;
 			if (single_map) {
@@ -157,7 +940,7 @@ void layout::do_maps(int fd)
 			void *mem = mmap(NULL,
 				align(map[i].size, PAGEBITS),
 				PROT_READ|PROT_WRITE,
-				MAP_SHARED, fd, pos);
+				share(), fd, pos);
 			if (mem == MAP_FAILED)
 				errno_exit(1);
 			*map[i].mem = mem;
@@ -166,6 +949,30 @@ void layout::do_maps(int fd)
 
 	if (ftruncate(fd, size))
 		errno_exit(1);
+
+	for (unsigned i = 0; i < count; i++)
+		if (map[i].size && map[i].mem)
+			region_policy(map[i]);
+}
+
+/*
+ * Pmem backend maps synchronously so cache flushes alone persist stores,
+ * with no file system metadata left to sync behind them.
+ */
+int layout::share()
+{
+	return pmconfig.backend == pm_pmem ? MAP_SHARED_VALIDATE|MAP_SYNC : MAP_SHARED;
+}
+
+/* Write back and wait on all dirty pages of the mapped file, for pagecache */
+int layout::sync()
+{
+	if (single_map)
+		return msync(base, size, MS_SYNC) ? -errno : 0;
+	for (unsigned i = 0; i < map.size(); i++)
+		if (map[i].size && map[i].mem && msync(*map[i].mem, align(map[i].size, PAGEBITS), MS_SYNC))
+			return -errno;
+	return 0;
 }
 
 void layout::redo_maps(int fd)
@@ -182,11 +989,16 @@ tier::tier(const struct header &header, const struct header::tierhead &tierhead)
 	stridebits(tierhead.stridebits),
 	locbits(tierhead.locbits),
 	sigbits(tierhead.sigbits),
-	countbuf(tierhead.is_empty() ? NULL : getbuf(power2(mapbits + countshift))),
+	countbuf(tierhead.is_empty() ? NULL : getbuf(countsize())),
 	countmap(NULL),
+	countdirty(tierhead.is_empty() ? NULL : (u64 *)getbuf(std::max(countsize() >> lineshift >> 3, (unsigned)sizeof(u64)))),
 	shardmap(NULL),
 	countmap_pos(0), shardmap_pos(0)
-	{}
+{
+	/* media counts of a new tier are unknown, so first unify writes them all */
+	if (countdirty)
+		memset(countdirty, 0xff, std::max(countsize() >> lineshift >> 3, (unsigned)sizeof(u64)));
+}
 
 #if 0
 tier::~tier()
@@ -202,18 +1014,51 @@ void tier::cleanup()
 {
 	trace("free countbuf %p", countbuf);
 	free(countbuf);
+	free(countdirty);
 	countbuf = NULL;
+	countdirty = NULL;
 }
 
-count_t *tier::getbuf(unsigned size)
+/* Count buffer bytes, at least one cache line so lines can be written whole */
+unsigned tier::countsize() const { return std::max(power2(mapbits + countshift), (u64)linesize); }
+
+void tier::dirty(unsigned ix) const
 {
-	count_t *buf = (count_t *)aligned_alloc(size, size); // check null!!!
-	trace("tier %p countbuf %p", this, buf);
-	memset(buf, 0, size);
-	return buf;
+	unsigned line = ix >> (lineshift - countshift);
+	countdirty[line >> 6] |= 1ULL << (line & 63);
 }
 
-cell_t *tier::at(unsigned ix, unsigned i) const
+/*
+ * Copy out count lines changed since the last unify for write back to
+ * media. Usually a handful of lines, where writing the whole count map
+ * would cost four bytes per shard every unify. Copies, because the front
+ * buffer keeps changing while a background unify writes them.
+ */
+void tier::stage_counts(std::vector<struct countline> &out)
+{
+	unsigned lines = countsize() >> lineshift;
+	for (unsigned word = 0; word < (lines + 63) >> 6; word++) {
+		for (u64 bits = countdirty[word]; bits; bits &= bits - 1) {
+			unsigned line = (word << 6) + __builtin_ctzll(bits);
+			if (line >= lines)
+				break;
+			struct countline copy = {countmap + (line << (lineshift - countshift))};
+			memcpy(copy.data, countbuf + (line << (lineshift - countshift)), linesize);
+			out.push_back(copy);
+		}
+		countdirty[word] = 0;
+	}
+}
+
+count_t *tier::getbuf(unsigned size)
+{
+	count_t *buf = (count_t *)aligned_alloc(size, size); // check null!!!
+	trace("tier %p countbuf %p", this, buf);
+	memset(buf, 0, size);
+	return buf;
+}
+
+cell_t *tier::at(unsigned ix, unsigned i) const
 {
 	assert(ix < 1U << mapbits);
 	assert(i < 1U << (stridebits - cellshift));
@@ -244,12 +1089,39 @@ struct fifo
 	}
 };
 
-struct media_fifo : fifo // what is this??
+/*
+ * Flatten must not rewrite a fifo in place while recovery still trusts it,
+ * that is, until unify makes the new count durable. So on a durable backend
+ * unify_begin writes the new fifo as an image to the spare stride after the
+ * last shard stride of the tier: a tag cell, then per image a cell naming
+ * the shard and its new count, then the image. Unify makes the images
+ * durable, then the counts, then copies each image over its fifo and drops
+ * the tag. After a crash the count on media picks the fifo: the old count
+ * the untouched old fifo, the new count the image. See shadow_flatten.
+ */
+struct shadowtag { char magic[4]; u32 images; };
+struct shadow { u32 ix, count; };
+
+cell_t *tier::spare() const
 {
-	media_fifo(const struct tier &tier, const unsigned i) :
-		fifo(tier.at(i, 0), power2(tier.stridebits - cellshift))
-		{}
-};
+	return shardmap + power2(stridebits - cellshift + mapbits);
+}
+
+/* Fifo to replay for a media count, a flatten image if one has that count */
+const cell_t *tier::fifo(unsigned ix, unsigned count) const
+{
+	const cell_t *cell = spare() + 1, *top = spare() + power2(stridebits - cellshift);
+	struct shadowtag tag;
+	memcpy(&tag, spare(), sizeof tag);
+	for (unsigned i = 0; !memcmp(tag.magic, "flat", 4) && i < tag.images && cell < top; i++) {
+		struct shadow shadow;
+		memcpy(&shadow, cell, sizeof shadow);
+		if (shadow.ix == ix && shadow.count == count)
+			return cell + 1;
+		cell += 1 + shadow.count;
+	}
+	return at(ix, 0);
+}
 
 unsigned shard::buckets() { return power2(tablebits); }
 bool shard::bucket_used(const unsigned i) { return table[i].key_loc_link != noentry; }
@@ -274,15 +1146,30 @@ void shard::rewind()
 count_t &shard::mediacount() const { return tier().countbuf[ix]; }
 unsigned shard::buckets() const { return power2(tablebits); }
 
-void shard::imprint()
+/* First cell of every media fifo */
+cell_t shard::magic() const
 {
 	struct {char a[4]; u16 b[2];} magic = {
 		{'f', 'i', 'f', 'o'},
 		{ix, tier().shards()}};
-	memcpy(tier().at(ix, 0), &magic, 8);
+	cell_t cell;
+	memcpy(&cell, &magic, sizeof cell);
+	return cell;
+}
+
+/* Start an empty media fifo, leaving the count map dirty bit to the caller */
+void shard::stamp()
+{
+	*tier().at(ix, 0) = magic();
 	mediacount() = 1;
 }
 
+void shard::imprint()
+{
+	stamp();
+	tier().dirty(ix);
+}
+
 #if 0
 void shard::append(cell_t value) // hardly used!
 {
@@ -373,7 +1260,9 @@ int shard::load_from_media()
 
 	unsigned n = mediacount();
 	trace("%i entries", n);
-	cell_t *media = tier().at(ix, 0);
+	const cell_t *media = map->readonly ? tier().fifo(ix, n) : tier().at(ix, 0); // live fifos are current
+	if (n > PAGE_SIZE / sizeof *media)
+		advise((void *)media, (u64)n * sizeof *media, MADV_WILLNEED); // start readahead of the whole fifo
 
 	for (unsigned j = 1; j < n; j++) {
 		cell_t entry = media[j];
@@ -415,9 +1304,36 @@ int shard::load_from_media()
  * Rewrite a media shard from cache to squeeze out tombstones
  */
 int shard::flatten()
+{
+	timed timer(map->timing, time_flatten);
+	map->count(stat_flatten);
+	rewrite();
+	tier().dirty(ix);
+	return 0;
+}
+
+/*
+ * Media fifo writes of flatten. Touches only the stride and count of this
+ * shard, so distinct shards may be rewritten in parallel, with the count
+ * map dirty bits, which share words, and stats left to the caller.
+ */
+void shard::rewrite()
 {
 	trace("shard %u buckets %u entries %u", ix, buckets(), count);
-	struct media_fifo media(tier(), ix);
+	mediacount() = image(tier().at(ix, 0));
+	assert(mediacount() == count + 1);
+	if (0)
+		hexdump(tier().at(ix, 0), power2(cellshift, mediacount()));
+}
+
+/*
+ * Write the fifo flatten would leave, magic then one cell per entry, by
+ * streaming stores that the next fence makes durable. Returns cells.
+ */
+unsigned shard::image(cell_t *to)
+{
+	struct fifo media(to, count + 1);
+	ntstore64(media.tail++, magic());
 	for (unsigned bucket = 0; bucket < buckets(); bucket++) {
 		if (bucket_used(bucket)) {
 			unsigned link = bucket;
@@ -427,18 +1343,35 @@ int shard::flatten()
 				tri_unpack(&tri, table[link].key_loc_link, next, loc, lowkey);
 				hashkey_t key = power2(lowbits, bucket) | lowkey;
 				trace_off("[%x] %lx => %lx", bucket, key, loc);
-				media.push(duo_pack(&tier().duo, key, loc));
+				assert(!media.full());
+				ntstore64(media.tail++, duo_pack(&tier().duo, key, loc));
 				if (!next)
 					break;
 				link = next;
 			}
 		}
 	}
-	mediacount() = media.size();
-	assert(mediacount() <= count + 1);
-	if (0)
-		hexdump(tier().at(ix, 0), power2(cellshift, mediacount()));
-	return 0;
+	return media.size();
+}
+
+/*
+ * Media fifo mostly dead cells (tombstones and the inserts they cancel) or
+ * too close to the end of its stride to absorb another full log burst.
+ */
+bool shard::is_bloated() const
+{
+	enum {slack = 64};
+	unsigned cells = mediacount();
+	return cells > 2 * (count + 1) + slack || cells + map->logsize * map->loglanes > power2(tier().stridebits - cellshift);
+}
+
+/*
+ * Every logged cell is in media and the count is persisted, so the shard can
+ * be dropped from cache and rebuilt exactly by populate.
+ */
+bool shard::is_clean() const
+{
+	return mediacount() == tier().countmap[ix];
 }
 
 void shard::reshard_part(struct shard *out, unsigned more_shards, unsigned part)
@@ -464,7 +1397,11 @@ void shard::reshard_part(struct shard *out, unsigned more_shards, unsigned part)
 	}
 }
 
-shard::~shard() { ::free(table); }
+shard::~shard()
+{
+	map->cachebytes -= sizeof *this + top * sizeof *table;
+	table_free(table, log2_ceiling(top * sizeof *table), node);
+}
 
 // is there a better place to put these???
 unsigned guess_linkbits(const unsigned tablebits, const fixed8 loadfactor)
@@ -493,11 +1430,53 @@ unsigned calc_sigbits(const unsigned tablebits, const fixed8 loadfactor, const u
 	return sigbits;
 }
 
-static unsigned mapid = 1; // could be different every run, is that ok??
+/*
+ * Choose final geometry for a bulk load of the given number of records so
+ * that no rehash, reshard or map growth is needed: enough shards at maximum
+ * table size to hold all entries with some margin for uneven distribution,
+ * and enough block address bits for the packed record blocks. Returns
+ * -EINVAL, leaving the header alone, if that needs more shards than the
+ * map supports.
+ */
+int keymap::bulk_geometry(struct header &header, u64 records, unsigned reclen, unsigned keylen)
+{
+	enum {margin_order = 3, max_mapbits = 15};
+
+	unsigned blocksize = power2(header.blockbits);
+	u64 per_block = (blocksize - sizeof(struct rb)) / (reclen + keylen + tabent_size);
+	u64 blocks = (records + per_block - 1) / per_block;
+	blocks += (blocks >> header.blockbits) + 2; // bigmap blocks and first map block
+	u64 entries = records + (records >> margin_order);
+	unsigned tablebits = header.maxtablebits;
+	u64 limit = mul8(header.loadfactor, power2(tablebits));
+
+	while (tablebits > header.tablebits && entries <= mul8(header.loadfactor, power2(tablebits - 1)))
+		limit = mul8(header.loadfactor, power2(--tablebits));
+
+	unsigned mapbits = log2_ceiling((entries + limit - 1) / limit);
+	if (mapbits > max_mapbits)
+		return -EINVAL;
+	unsigned locbits = std::max((unsigned)header.upper.locbits, log2_ceiling(blocks + 1));
+	unsigned linkbits = guess_linkbits(tablebits, header.loadfactor);
+	unsigned sigbits = std::min(calc_sigbits(tablebits, header.loadfactor, locbits), 63 - mapbits);
+
+	header.tablebits = tablebits;
+	header.upper = (struct header::tierhead){
+		.mapbits = mapbits,
+		.stridebits = std::max((unsigned)header.upper.stridebits, linkbits + cellshift),
+		.locbits = locbits,
+		.sigbits = sigbits };
+	header.lower = (struct header::tierhead){};
+	trace_geom("%lu records: mapbits %u tablebits %u locbits %u sigbits %u stridebits %u",
+		records, mapbits, tablebits, locbits, sigbits, header.upper.stridebits);
+	return 0;
+}
+
+static std::atomic<unsigned> mapid{1}; // could be different every run, is that ok??
 
 keymap::keymap(struct header &header, const int fd, struct recops &recops, unsigned reclen) :
 	bigmap(), // unfortunately impossible to initialize bigmap members here
-	map(0), tiers({{header, header.upper}, {header, header.lower}}),
+	map(0), tiers{{header, header.upper}, {header, header.lower}},
 	tablebits(header.tablebits),
 	shards(power2(upper->mapbits)), pending(0),
 	loadfactor(header.loadfactor),
@@ -516,26 +1495,120 @@ keymap::keymap(struct header &header, const int fd, struct recops &recops, unsig
 	bigmap::reclen = reclen; // the standard is lame.
 	keymask = bitmask(upper->mapbits + (sigbits = upper->sigbits)); // need redundant sigbits field???
 	mapmask = bitmask(upper->mapbits); // need redundant mapmask field???
+	logorder = header.logorder = header.logorder ? : logorder_default;
+	loglanes = header.loglanes = header.loglanes ? : 1;
+	if (logorder < logorder_min || logorder > logorder_max || loglanes > loglanes_max)
+		error_exit(1, "microlog order %u lanes %u out of range", logorder, loglanes);
+	logsize = power2(logorder);
+	logmask = logsize - 1;
+	logbatch = logsize >> 1; // log entries per unify, including unify entry
+	statslots = new struct statslot[statslots_max]();
 
 	if (fd > 0) {
 		define_layout(layout.map);
 		layout.do_maps(fd);
 		bigmap_open(this);
-		u8 *frontbuf = (u8 *)aligned_alloc(power2(cellshift, blockcells), blocksize);
+		u8 *frontbuf = (u8 *)aligned_alloc(PAGE_SIZE, blocksize); // block pool io may be O_DIRECT
 		path[0].map = (struct datamap){.data = frontbuf};
 		maxblocks = layout.map[map_rbspace].size >> blockbits;
 		add_new_rec_block(this);
 		recops.init(&sinkinfo());
-		log_clear(microlog);
+		log_clear(microlog, loglanes * logsize);
 #ifdef SIDELOG
-		Private = (struct sidelog *)calloc(1, sidelog_size);
+		Private = (struct sidelog *)calloc(loglanes * logsize, sizeof(struct sidelog));
 #endif
+		lanes = (struct loglane *)aligned_alloc(alignof(struct loglane), loglanes * sizeof *lanes);
+		memset(lanes, 0, loglanes * sizeof *lanes);
+		write_super();
 	}
 
 	if (0)
 		populate_all();
 }
 
+/*
+ * Open a closed map file read only, by its superblock. Count maps are
+ * copied to count buffers as populate expects, nothing else is set up to
+ * write, so this is only good for lookups and inspection.
+ */
+keymap::keymap(struct superblock &super, const int fd, struct recops &recops) :
+	bigmap(),
+	map(0), tiers{{super.header, super.header.upper}, {super.header, super.header.lower}},
+	tablebits(super.header.tablebits),
+	shards(power2(upper->mapbits)), pending(!lower->is_empty()),
+	loadfactor(super.header.loadfactor),
+	peek({NULL, -1}),
+	header(super.header),
+	recops(recops),
+	sinkbh{power2(super.header.blockbits), super.reclen, 0, 0, this},
+	peekbh{power2(super.header.blockbits), super.reclen, 0, 0, this},
+	fd(fd), id(mapid++), Private(0), readonly(1)
+{
+	map = mapalloc();
+	blockbits = header.blockbits;
+	blocksize = power2(blockbits);
+	bigmap::reclen = super.reclen;
+	keymask = bitmask(upper->mapbits + (sigbits = upper->sigbits));
+	mapmask = bitmask(upper->mapbits);
+	logorder = header.logorder;
+	loglanes = header.loglanes;
+	logsize = power2(logorder);
+	logmask = logsize - 1;
+	logbatch = logsize >> 1;
+	statslots = new struct statslot[statslots_max]();
+
+	layout.size = super.size;
+	layout.base = mmap(NULL, super.size, PROT_READ, MAP_SHARED, fd, 0);
+	if (layout.base == MAP_FAILED)
+		errno_exit(1);
+	u8 *base = (u8 *)layout.base;
+	this->super = (struct superblock *)base;
+	rbspace = base + (rbspace_pos = super.rbspace);
+	for (unsigned tx = 0; tx < 2; tx++) {
+		struct tier &tier = tiers[tx];
+		if (tier.is_empty())
+			continue;
+		tier.countmap = (count_t *)(base + super.countmap[tx]);
+		tier.shardmap = (cell_t *)(base + super.shardmap[tx]);
+		memcpy(tier.countbuf, tier.countmap, tier.countsize());
+	}
+	blocks = super.blocks;
+	maxblocks = super.maxblocks;
+	bigmap_open(this);
+}
+
+int keymap::read_super(int fd, struct superblock &super)
+{
+	struct stat stat;
+	int got = pread(fd, &super, sizeof super, 0);
+	if (got < 0 || fstat(fd, &stat))
+		return -errno;
+	if (got != sizeof super || memcmp(super.magic, "shardmap", 8) || super.version != super_version)
+		return -EINVAL;
+	if ((u64)stat.st_size < super.size || super.rbspace + power2(super.header.blockbits, super.blocks) > super.size)
+		return -EINVAL;
+	return 0;
+}
+
+/* Rewrite the superblock if anything it records changed, owner only */
+void keymap::write_super()
+{
+	if (!super || readonly)
+		return;
+	auto offset = [this](void *mem) -> u64 { return mem ? (u8 *)mem - (u8 *)layout.base : 0; };
+	struct superblock fresh = {
+		{'s', 'h', 'a', 'r', 'd', 'm', 'a', 'p'}, super_version, reclen,
+		(u64)layout.size, blocks, maxblocks, offset(rbspace),
+		{offset(upper->countmap), offset(lower->countmap)},
+		{offset(upper->shardmap), offset(lower->shardmap)},
+		header};
+	fresh.header.blocks = blocks;
+	if (!memcmp(super, &fresh, sizeof fresh))
+		return;
+	pmwrite(super, &fresh, sizeof fresh);
+	sfence();
+}
+
 struct shard *keymap::new_shard(const struct tier *tier, unsigned i, unsigned tablebits, bool virgin)
 {
 	struct shard *shard = new struct shard(this, tier, i, tablebits, guess_linkbits(tablebits, loadfactor));
@@ -554,6 +1627,32 @@ struct shard **keymap::mapalloc()
 
 keymap::~keymap()
 {
+	if (fd > 0 && !readonly) {
+		unify(); // leave media complete for a later open
+		for (unsigned i = 1; i < levels; i++) {
+			struct datamap &dm = path[i].map;
+			if (dm.data && dm.loc < blocks && is_maploc(dm.loc, blockbits))
+				write_block(dm.loc, dm.data);
+		}
+	}
+	unify_wait();
+	if (flusher)
+		trace("[%u] unify %u batches, %u stalls", id, flusher->batches, flusher->stalls);
+	delete flusher;
+	if (pool) {
+		std::vector<std::pair<loc_t, unsigned>> frames; // keep in place changes, as the file map does
+		pool->take_dirty(frames);
+		pool->write_back(frames, pmconfig.backend != pm_volatile);
+		delete pool;
+	}
+	if (super && !readonly) {
+		write_super();
+		if (pmconfig.backend == pm_pagecache)
+			layout.sync();
+	}
+	if (readonly)
+		munmap(layout.base, layout.size);
+
 	for (unsigned i = 0; i < levels; i++)
 		free(path[i].map.data); // danger!!! We assume these are front buffers
 
@@ -568,6 +1667,9 @@ keymap::~keymap()
 	tiers[0].cleanup();
 	tiers[1].cleanup();
 	free(map);
+	free(lanes);
+	free(timing);
+	delete[] statslots;
 #ifdef SIDELOG
 	free(Private);
 #endif
@@ -625,13 +1727,47 @@ void keymap::dump(unsigned flags)
 	}
 }
 
-unsigned keymap::burst() { return (logtail - loghead) & logmask; }
+unsigned keymap::burst(const struct loglane &lane) const { return (lane.tail - lane.head) & logmask; }
+
+/* Log entries not yet unified, all lanes */
+unsigned keymap::burst()
+{
+	unsigned entries = 0;
+	for (unsigned i = 0; i < loglanes; i++)
+		entries += burst(lanes[i]);
+	return entries;
+}
+
+/* Threads are numbered in order of first use, the same in every keymap */
+static unsigned thread_index()
+{
+	static std::atomic<unsigned> threads{0};
+	static thread_local unsigned index = threads++;
+	return index;
+}
+
+/*
+ * Threads take lanes round robin by thread index, so a writer never shares
+ * a tail with another writer unless there are more writers than lanes.
+ */
+struct loglane &keymap::lane()
+{
+	return lanes[thread_index() % loglanes];
+}
+
+/* Lane rings are consecutive runs of the microlog, which moves on relayout */
+struct pmblock *keymap::lanelog(const struct loglane &lane) const { return microlog + (&lane - lanes) * logsize; }
+struct sidelog *keymap::laneside(const struct loglane &lane) const { return (struct sidelog *)Private + (&lane - lanes) * logsize; }
+
+u64 keymap::microlog_size() const { return power2(logorder, loglanes * sizeof(struct pmblock)); }
 const struct tier &keymap::tier(const struct shard *shard) const { return tiers[shard->tx]; }
 unsigned keymap::tiershift(const struct tier &tier) const { return upper->mapbits - tier.mapbits; }
 bool keymap::single_tier() const { return !pending; }
 
 struct shard *keymap::populate(unsigned i, bool for_insert)
 {
+	timed timer(timing, time_populate);
+	count(stat_populate);
 	assert(!map[i]);
 	struct tier *tier = single_tier() || upper->countbuf[i] ? upper : lower;
 	unsigned count = tier->countbuf[i >> tiershift(*tier)];
@@ -653,7 +1789,69 @@ void keymap::populate_all()
 struct shard *keymap::getshard(unsigned i, bool for_insert)
 {
 	assert(i < shards);
-	return map[i] ? map[i] : populate(i, for_insert);
+	struct shard *shard = map[i];
+	if (!shard)
+		return populate(i, for_insert);
+	shard->hot = 1;
+	return shard;
+}
+
+/*
+ * Shard cache budget: a shard is only a cache of its media fifo, so a clean
+ * shard can be dropped and repopulated on demand. Clock sweep, giving shards
+ * referenced since the hand last passed a second chance. Lower tier shards
+ * are left alone because their counts are not persisted and they are about
+ * to be split anyway. If that is not enough, the log entries since the last
+ * unify are unified so the shards they touched become clean, then swept
+ * again. Unify flattens media fifos that churn has bloated, so
+ * repopulating a clean shard replays roughly its live entries.
+ */
+unsigned keymap::evict(u64 target)
+{
+	timed timer(timing, time_evict);
+	unsigned evicted = 0;
+	unify_wait(); // clean means count map is current
+	for (unsigned pass = 0; pass < 2 && cachebytes > target; pass++) {
+		if (pass) {
+			if (!burst())
+				break;
+			unify(); // shards logged to since the last unify are not clean
+		}
+		for (unsigned n = 2 * shards; n && cachebytes > target; n--) {
+			if (clock_at >= shards)
+				clock_at = 0;
+			struct shard *shard = map[clock_at++];
+			if (!shard || shard->is_lower() || !shard->is_clean())
+				continue;
+			if (shard->hot) {
+				shard->hot = 0;
+				continue;
+			}
+			trace("evict shard %u entries %u", shard->ix, shard->count);
+			spam(NULL, shard->ix, tiershift(tier(shard)));
+			delete shard;
+			evicted++;
+		}
+	}
+	count(stat_evict, evicted);
+	return evicted;
+}
+
+/*
+ * Only called on entry to a public operation, where no shard pointers are
+ * held, then trims to a low water mark to amortize the sweep.
+ */
+void keymap::keep_budget()
+{
+	if (cachebytes > cachebudget)
+		evict(cachebudget - (cachebudget >> 3));
+}
+
+/* Limit shard cache memory to bytes, zero for no limit, trimming now */
+void keymap::set_cache_budget(u64 bytes)
+{
+	cachebudget = bytes ? bytes : -1;
+	keep_budget();
 }
 
 struct shard *keymap::setshard(const unsigned i, struct shard *shard)
@@ -671,28 +1869,33 @@ u64 keymap::shardmap_size(struct tier *tier)
 
 void keymap::define_layout(std::vector<region> &map)
 {
-	u64 rbspace_size = power2(12 + 20);
-	u64 upper_countmap_size = power2(upper->mapbits + countshift);
+	/* record space never moves, so size it once for the initial geometry */
+	u64 rbspace_size = maxblocks ? power2(blockbits, maxblocks) :
+		std::max(power2(12 + 20), power2(blockbits + upper->locbits));
+	u64 upper_countmap_size = upper->countsize();
 	u64 upper_shardmap_size = shardmap_size(upper);
 	void **microlog_mem = (void **)&microlog;
 	upper_microlog = NULL;
 
-	map.push_back({rbspace_size, 12, (void **)&rbspace, &rbspace_pos});
+	map.push_back({super_size, 12, (void **)&super, NULL, 0});
+	map.push_back({rbspace_size, 21, (void **)&rbspace, &rbspace_pos, region::hugepage|region::random});
 	if (!lower->is_empty()) {
-		u64 lower_countmap_size = power2(lower->mapbits + countshift);
+		u64 lower_countmap_size = lower->countsize();
 		u64 lower_shardmap_size = shardmap_size(lower);
-		map.push_back({microlog_size, 12, microlog_mem, NULL});
-		map.push_back({lower_countmap_size, 12, (void **)&lower->countmap, &lower->countmap_pos});
-		map.push_back({lower_shardmap_size, 12, (void **)&lower->shardmap, &lower->shardmap_pos});
+		map.push_back({microlog_size(), 12, microlog_mem, NULL, region::populate});
+		map.push_back({lower_countmap_size, 12, (void **)&lower->countmap, &lower->countmap_pos, region::populate});
+		map.push_back({lower_shardmap_size, 21, (void **)&lower->shardmap, &lower->shardmap_pos, region::hugepage});
 		microlog_mem = NULL;
 	}
-	map.push_back({microlog_size, 12, microlog_mem ? : (void **)&upper_microlog, NULL});
-	map.push_back({upper_countmap_size, 12, (void **)&upper->countmap, &upper->countmap_pos});
-	map.push_back({upper_shardmap_size, 12, (void **)&upper->shardmap, &upper->shardmap_pos});
+	map.push_back({microlog_size(), 12, microlog_mem ? : (void **)&upper_microlog, NULL, region::populate});
+	map.push_back({upper_countmap_size, 12, (void **)&upper->countmap, &upper->countmap_pos, region::populate});
+	map.push_back({upper_shardmap_size, 21, (void **)&upper->shardmap, &upper->shardmap_pos, region::hugepage});
 }
 
 int keymap::rehash(const unsigned i, const unsigned more)
 {
+	timed timer(timing, time_rehash);
+	count(stat_rehash);
 	trace_geom("[%u] shard %u buckets 2^%u -> 2^%u", id, i, tablebits, tablebits + more);
 	unsigned out_tablebits = header.tablebits = tablebits = tablebits + more; // quietly adjusts default tablebits!
 	struct shard *shard = map[i];
@@ -707,21 +1910,53 @@ int keymap::rehash(const unsigned i, const unsigned more)
 
 int keymap::reshard(const unsigned i, const unsigned more_shards, const unsigned more_buckets)
 {
+	timed timer(timing, time_reshard);
+	count(stat_reshard);
 	struct shard *shard = map[i];
 	assert(shard->is_lower());
 	unsigned more_per_shard = more_buckets - more_shards;
 	unsigned out_tablebits = tablebits + more_per_shard;
 	trace("reshard %u 2^%i (2^%i buckets per shard)", i, more_shards, out_tablebits);
-	for (unsigned part = 0, parts = power2(more_shards); part < parts; part++) {
+	unify_wait(); // new shards flatten over media fifos
+
+	/*
+	 * Parts scan disjoint bucket ranges of the old shard into shards of
+	 * their own and rewrite their own media fifos, so a large split runs
+	 * them on the maintenance pool. Allocation, count map dirty bits and
+	 * stats are shared, so done here, and the map sees every new shard at
+	 * once when all parts are done. Each part is timed as a flatten, its
+	 * cycles kept aside until then because histograms are not shared.
+	 */
+	enum {parallel_entries = 1 << 16};
+	unsigned parts = power2(more_shards);
+	std::vector<struct shard *> split(parts);
+	std::vector<u64> cycles(timing ? parts : 0);
+	for (unsigned part = 0; part < parts; part++)
+		split[part] = new_shard(upper, i + part, out_tablebits);
+	auto build = [&](unsigned part) {
+		trace("map[%i] part %i", i + part, part);
+		u64 start = timing ? __rdtsc() : 0;
+		shard->reshard_part(split[part], more_shards, part);
+		split[part]->rewrite();
+		if (timing)
+			cycles[part] = __rdtsc() - start;
+	};
+	if (parts > 1 && shard->count >= parallel_entries)
+		maint().parallel(parts, build);
+	else
+		for (unsigned part = 0; part < parts; part++)
+			build(part);
+	for (unsigned part = 0; part < parts; part++) {
 		unsigned j = i + part;
-		struct shard *newshard = new_shard(upper, j, out_tablebits);
-		trace("map[%i] part %i", j, part);
-		shard->reshard_part(newshard, more_shards, part);
 		assert(map[j] == shard);
-		map[j] = newshard;
-		newshard->flatten();
+		map[j] = split[part];
+		upper->dirty(split[part]->ix);
+		count(stat_flatten);
+		if (timing)
+			timing->event[time_flatten].add(cycles[part]);
 	}
 	shard->mediacount() = 0;
+	tier(shard).dirty(shard->ix);
 //	shard_unmap(shard);
 	delete shard;
 	return 0;
@@ -772,6 +2007,9 @@ void keymap::force_pending() // untested
  */
 int keymap::add_tier(const unsigned more)
 {
+	timed timer(timing, time_add_tier);
+	count(stat_add_tier);
+	unify_wait(); // remaps media
 	unsigned locbits = log2_ceiling(blocks << (more + 1));
 	if (locbits < upper->locbits) {
 		/*
@@ -804,7 +2042,13 @@ int keymap::add_tier(const unsigned more)
 
 	layout.map.clear();
 	define_layout(layout.map);
-	layout.redo_maps(fd);
+	{
+		timed timer(timing, time_redo_maps);
+		layout.redo_maps(fd);
+	}
+	if (nodes > 1)
+		bind_media();
+	write_super();
 
 	trace_geom("mapbits %u maploc %x mapsize %lx filesize %lx sigbits %u locbits %u",
 		mapbits, maploc, layout.size - upper->countmap_pos, layout.size,
@@ -816,6 +2060,7 @@ int keymap::add_tier(const unsigned more)
 void keymap::drop_tier()
 {
 	trace_geom("drop tier");
+	count(stat_drop_tier);
 	assert(!pending);
 	unify(); // retire any lower tier updates still in flight
 
@@ -824,15 +2069,18 @@ void keymap::drop_tier()
 		any += lower->countbuf[i];
 	assert(!any);
 
-	free(lower->countbuf);
+	lower->cleanup();
 	*lower = (struct tier){};
 	header.lower = (struct header::tierhead){};
-	assert(loghead == logtail);
+	assert(!burst());
 	microlog = upper_microlog;
+	write_super();
 }
 
 int keymap::grow_map(const unsigned more)
 {
+	timed timer(timing, time_grow_map);
+	count(stat_grow_map);
 	trace_geom("expand map x%u to 2^%u", 1 << more, upper->mapbits + more);
 	assert(!pending);
 
@@ -933,21 +2181,256 @@ int keymap::remove(const char *key, unsigned len)
 
 rec_t *keymap::lookup(const void *key, unsigned len)
 {
+	timed timer(timing, time_lookup);
+	keep_budget();
 	hashkey_t hash = keyhash(key, len) & keymask;
 	struct shard *shard = getshard(hash >> sigbits, 0);
-	return shard ? shard->lookup(key, len, hash) : NULL;
+	rec_t *rec = shard ? shard->lookup(key, len, hash) : NULL;
+	count(stat_lookups);
+	count(rec ? stat_hits : stat_misses);
+	return rec;
+}
+
+/*
+ * Look up a batch of keys, passing each result to fn while its record
+ * pointer is still good. With a block pool, blocks the keys may live in are
+ * read first as one batch, instead of one synchronous read per miss.
+ */
+void keymap::lookup_many(const void *const keys[], const unsigned lens[], unsigned n, multiget_fn fn)
+{
+	if (pool) {
+		std::vector<loc_t> locs;
+		for (unsigned i = 0; i < n; i++) {
+			hashkey_t hash = keyhash(keys[i], lens[i]) & keymask;
+			struct shard *shard = getshard(hash >> sigbits, 0);
+			if (shard)
+				shard->candidates(hash, locs);
+		}
+		locs.erase(std::remove_if(locs.begin(), locs.end(), [this](loc_t loc) {
+			return loc == path[0].map.loc || loc == flushing; }), locs.end());
+		pool->prefetch(locs);
+	}
+	for (unsigned i = 0; i < n; i++)
+		fn(i, lookup(keys[i], lens[i]));
+}
+
+/* Shard table allocator */
+
+/*
+ * Shard tables are power of two sized and get freed and reallocated
+ * wholesale by rehash, reshard and eviction. So recycle them through a free
+ * list per size order, carving small ones from 2 MB arenas. Arenas are
+ * hugepage backed where possible to cut TLB misses on random probes:
+ * MAP_HUGETLB if pages are reserved, otherwise 2 MB aligned and advised
+ * for transparent hugepages. Memory goes back to the pool, never to the
+ * system. In numa mode each node has its own lists and arenas bound to it.
+ */
+struct tablestats tablestats;
+
+static struct tablepool
+{
+	enum {arenabits = 21, orders = 48};
+	std::mutex lock;
+	void *free[numa_maxnodes + 1][orders]; // per node plus one for none, linked through first cell
+	bool nohugetlb;
+} tablepool;
+
+static void *arena_map(u64 size, int node)
+{
+	enum {arenasize = 1 << tablepool::arenabits};
+	size = (size + arenasize - 1) & -(u64)arenasize;
+
+	if (!tablepool.nohugetlb) {
+		void *mem = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+		if (mem != MAP_FAILED) {
+			if (node >= 0)
+				numa_bind(mem, size, node);
+			tablestats.mapped += size;
+			tablestats.hugetlb += size;
+			return mem;
+		}
+		tablepool.nohugetlb = 1; // no reserved hugepages, stop asking
+	}
+
+	u8 *mem = (u8 *)mmap(NULL, size + arenasize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return NULL;
+	u8 *base = (u8 *)(((uintptr_t)mem + arenasize - 1) & -(uintptr_t)arenasize);
+	if (base > mem)
+		munmap(mem, base - mem);
+	munmap(base + size, mem + arenasize - base);
+	if (!madvise(base, size, MADV_HUGEPAGE))
+		tablestats.advised += size;
+	if (node >= 0)
+		numa_bind(base, size, node);
+	tablestats.mapped += size;
+	return base;
+}
+
+void *table_alloc(unsigned order, int node)
+{
+	assert(order < tablepool::orders && node < numa_maxnodes);
+	std::lock_guard<std::mutex> guard(tablepool.lock);
+	void **free = tablepool.free[node + 1], *table = free[order];
+
+	if (table) {
+		free[order] = *(void **)table;
+		tablestats.recycled++;
+	} else if (order >= tablepool::arenabits) {
+		table = arena_map(power2(order), node);
+	} else if ((table = arena_map(power2(tablepool::arenabits), node))) {
+		u8 *arena = (u8 *)table;
+		for (u64 at = power2(tablepool::arenabits); (at -= power2(order));) {
+			*(void **)(arena + at) = free[order];
+			free[order] = arena + at;
+		}
+	}
+
+	if (table) {
+		tablestats.allocs++;
+		tablestats.inuse += power2(order);
+	}
+	return table;
+}
+
+void table_free(void *table, unsigned order, int node)
+{
+	std::lock_guard<std::mutex> guard(tablepool.lock);
+	void **free = tablepool.free[node + 1];
+	*(void **)table = free[order];
+	free[order] = table;
+	tablestats.inuse -= power2(order);
+}
+
+/* NUMA placement */
+
+/*
+ * Numa mode splits the shard index, that is the high hash bits, into one
+ * contiguous range per node. A node owns the hash tables of its shards, the
+ * media fifos of those shards in each tier, and is meant to own the worker
+ * threads that serve its keys, so a lookup stays on one socket from key to
+ * index. Record blocks are still shared, as the sink is shared. Binding is
+ * best effort: page cache pages of an ordinary file follow the policy of
+ * the faulting task rather than the mapping, which is the other reason to
+ * run workers on the node that owns their keys.
+ */
+static int parse_cpulist(const char *path, cpu_set_t *set)
+{
+	char buf[1024];
+	int fd = open(path, O_RDONLY), len = fd < 0 ? -1 : read(fd, buf, sizeof buf - 1);
+	if (fd >= 0)
+		close(fd);
+	if (len <= 0)
+		return -ENOENT;
+	buf[len] = 0;
+
+	CPU_ZERO(set);
+	for (char *p = buf; *p && *p != '\n';) {
+		unsigned lo = strtoul(p, &p, 10), hi = lo;
+		if (*p == '-')
+			hi = strtoul(p + 1, &p, 10);
+		for (unsigned cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, set);
+		if (*p == ',')
+			p++;
+	}
+	return 0;
+}
+
+/*
+ * Store the ids of online nodes, which need not be contiguous, and return
+ * how many there are. Without numa support that is just node zero.
+ */
+unsigned numa_online(u8 *ids)
+{
+	cpu_set_t set; // node list has the same syntax as a cpu list
+	unsigned count = 0;
+	if (!parse_cpulist("/sys/devices/system/node/online", &set))
+		for (unsigned node = 0; node < numa_maxnodes; node++)
+			if (CPU_ISSET(node, &set))
+				ids[count++] = node;
+	if (!count)
+		ids[count++] = 0;
+	return count;
+}
+
+int numa_bind(void *mem, u64 size, unsigned node)
+{
+	unsigned long mask = 1UL << node;
+	if (syscall(SYS_mbind, mem, size, MPOL_BIND, &mask, sizeof mask * 8, 0)) {
+		trace("mbind node %u failed (%s)", node, strerror(errno));
+		return -errno;
+	}
+	return 0;
+}
+
+int numa_run_on(unsigned node)
+{
+	char path[64];
+	cpu_set_t set;
+	snprintf(path, sizeof path, "/sys/devices/system/node/node%u/cpulist", node);
+	int err = parse_cpulist(path, &set);
+	if (err)
+		return err;
+	return sched_setaffinity(0, sizeof set, &set) ? -errno : 0;
+}
+
+/*
+ * Partition shard tables and media fifos over the given number of nodes,
+ * by default all online nodes. Ranges map onto online node ids in order,
+ * wrapping if more ranges are asked for than there are nodes. Tables
+ * allocated before this stay where they are, so call it before first use.
+ */
+void keymap::set_numa(unsigned nodes)
+{
+	u8 online[numa_maxnodes];
+	unsigned count = numa_online(online);
+	this->nodes = std::min(nodes ? : count, (unsigned)numa_maxnodes);
+	for (unsigned i = 0; i < this->nodes; i++)
+		nodeid[i] = online[i % count];
+	if (this->nodes > 1)
+		bind_media();
+}
+
+int keymap::shard_node(unsigned i) const
+{
+	return nodes > 1 ? nodeid[((u64)(i & (shards - 1)) * nodes) >> upper->mapbits] : -1;
+}
+
+unsigned keymap::key_node(const void *key, unsigned len) const
+{
+	int node = shard_node((keyhash(key, len) & keymask) >> sigbits);
+	return node < 0 ? 0 : node;
+}
+
+void keymap::bind_media()
+{
+	for (unsigned t = 0; t < 2; t++) {
+		const struct tier &tier = tiers[t];
+		if (tier.is_empty() || !tier.shardmap)
+			continue;
+		for (unsigned j = 0, n = tier.shards(), run = 0; j <= n; j++) {
+			unsigned range = ((u64)run * nodes) >> tier.mapbits;
+			if (j < n && (((u64)j * nodes) >> tier.mapbits) == range)
+				continue;
+			numa_bind(tier.at(run, 0), power2(tier.stridebits, j - run), nodeid[range]);
+			run = j;
+		}
+	}
 }
 
 shard::shard(struct keymap *map, const struct tier *tier, unsigned i, unsigned tablebits, unsigned linkbits) :
 	free(endlist), top(power2(linkbits)), // should depend on limit!!!
 	count(0), limit(mul8(map->loadfactor, power2(tablebits))), // must not be more than cells(stride) - 1 (magic)
-	tablebits(tablebits), lowbits(tier->sigbits - tablebits), tx(tier - map->tiers), ix(i >> map->tiershift(*tier)),
-	map(map), tri(new_tri(linkbits, tier->locbits))
+	tablebits(tablebits), lowbits(tier->sigbits - tablebits), node(map->shard_node(i)),
+	tx(tier - map->tiers), ix(i >> map->tiershift(*tier)),
+	hot(1), map(map), tri(new_tri(linkbits, tier->locbits))
 {
 	assert(tablebits <= linkbits);
 	assert(power2(cellshift, top) <= power2(tier->stridebits));
-	table = (struct shard_entry *)malloc(top * sizeof *table);
+	table = (struct shard_entry *)table_alloc(log2_ceiling(top * sizeof *table), node);
 	assert(table); // do something!
+	map->cachebytes += sizeof *this + top * sizeof *table;
 	trace("buckets %i limit %i top %i lowbits %u linkbits %u", (int)power2(tablebits), limit, top, lowbits, tablebits);
 	empty();
 }
@@ -955,8 +2438,6 @@ shard::shard(struct keymap *map, const struct tier *tier, unsigned i, unsigned t
 const struct tier &shard::tier() const { return map->tiers[tx]; }
 bool shard::is_lower() { return tx == map->lower - map->tiers; }
 
-unsigned long tests = 0, probes = 0;
-
 rec_t *shard::lookup(const void *key, unsigned len, hashkey_t hash)
 {
 	trace("find '%s'", cprinz(key, len));
@@ -964,24 +2445,44 @@ rec_t *shard::lookup(const void *key, unsigned len, hashkey_t hash)
 	unsigned link = (hash >> lowbits) & bitmask(tablebits);
 	trace("hash %lx ix %i:%x bucket %x", hash, is_lower(), ix, link);
 	if (bucket_used(link)) {
-		tests++;
+		unsigned chain = 0, probes = 0;
+		rec_t *rec = NULL;
 		do {
 			const cell_t &entry = table[link].key_loc_link;
+			chain++;
 			if (tri_third(&tri, entry) == lowhash) {
 				loc_t loc = tri_second(&tri, entry);
 				trace("probe block %i:%x", map->id, loc);
 				probes++;
 				struct recinfo &ri = map->peekinfo(loc);
-				rec_t *rec = map->recops.lookup((struct recinfo *)&ri, key, len, hash);
-				if (rec)
-					return rec;
+				if ((rec = map->recops.lookup((struct recinfo *)&ri, key, len, hash)))
+					break;
 			}
 			link = next_entry(link);
 		} while (link != endlist);
+		map->count(stat_buckets);
+		map->count(stat_chain, chain);
+		map->count(stat_probes, probes);
+		return rec;
 	}
 	return NULL;
 }
 
+/* Blocks a lookup of this key would probe, without reading them */
+void shard::candidates(hashkey_t hash, std::vector<loc_t> &locs)
+{
+	cell_t lowhash = hash & bitmask(lowbits);
+	unsigned link = (hash >> lowbits) & bitmask(tablebits);
+	if (bucket_used(link)) {
+		do {
+			const cell_t &entry = table[link].key_loc_link;
+			if (tri_third(&tri, entry) == lowhash)
+				locs.push_back(tri_second(&tri, entry));
+			link = next_entry(link);
+		} while (link != endlist);
+	}
+}
+
 int shard::insert(const hashkey_t key, const loc_t loc)
 {
 	const unsigned bucket = (key >> lowbits) & bitmask(tablebits);
@@ -1074,17 +2575,36 @@ void shard::append_or_flatten(hashkey_t key, loc_t loc, cell_t flag)
 
 u8 *ext_bigmap_mem(struct bigmap *map, loc_t loc)
 {
+	struct keymap *keymap = static_cast<struct keymap *>(map);
+	if (loc == keymap->flushing)
+		keymap->unify_wait(); // media block is stale until the batch lands
+	if (keymap->pool)
+		return keymap->pool->get_recent(loc);
 	return map->rbspace + power2(map->blockbits, loc);
 }
 
+/*
+ * Path levels are front buffers. Write back a map block before its buffer
+ * is reused and load an existing block into the buffer. The sink at level
+ * zero is written back by unify before it moves, not here.
+ */
 void ext_bigmap_map(struct bigmap *map, unsigned level, loc_t loc)
 {
+	struct datamap *dm = &map->path[level].map;
+	bool exists = loc < map->blocks;
 	if (loc == map->blocks) {
 		if (map->blocks >= map->maxblocks)
 			error_exit(1, "too many blocks (%u)", map->blocks + 1);
 		map->blocks++;
 	}
-	map->path[level].map.loc = loc;
+	if (dm->data && dm->loc != loc) {
+		struct keymap *keymap = static_cast<struct keymap *>(map);
+		if (level && is_maploc(dm->loc, map->blockbits))
+			keymap->write_block(dm->loc, dm->data);
+		if (exists)
+			keymap->read_block(loc, dm->data);
+	}
+	dm->loc = loc;
 }
 
 void ext_bigmap_unmap(struct bigmap *map, struct datamap *dm)
@@ -1095,8 +2615,9 @@ void ext_bigmap_unmap(struct bigmap *map, struct datamap *dm)
 
 unsigned ext_bigmap_big(struct bigmap *map, struct datamap *dm)
 {
-	struct recinfo ri = {map->blocksize, map->reclen, dm->data};
-	return ri.map->recops.big(&ri);
+	struct keymap *keymap = static_cast<struct keymap *>(map);
+	struct recinfo ri = {map->blocksize, map->reclen, dm->data, dm->loc, keymap};
+	return keymap->recops.big(&ri);
 }
 
 /* High level db ops */
@@ -1122,52 +2643,54 @@ struct unify_logent
 
 void keymap::showlog()
 {
-	struct pmblock *log = microlog;
-
-	for (int i = 0; i < logsize; i++) {
-		struct pmblock block;
-		struct delete_logent entry;
-		log_read(&block, log, i);
-		memcpy(&entry, &block, sizeof entry); // stupid, but strict aliasing requires this!
-		printf("%i.%i", i, entry.logtype);
-		printf(" %lx %x %x %x", entry.duo, entry.ax, entry.ix, entry.at);
+	for (unsigned lx = 0; lx < loglanes; lx++) {
+		struct loglane &lane = lanes[lx];
+		for (unsigned i = 0; i < logsize; i++) {
+			struct pmblock block;
+			struct delete_logent entry;
+			log_read(&block, lanelog(lane), i);
+			memcpy(&entry, &block, sizeof entry); // stupid, but strict aliasing requires this!
+			printf("%u:%i.%i", lx, i, entry.logtype);
+			printf(" %lx %x %x %x", entry.duo, entry.ax, entry.ix, entry.at);
 #ifdef SIDELOG
-		struct sidelog *sidelog = (struct sidelog *)Private;
-		struct sidelog side = sidelog[i];
-		printf(" %lx %x %x %x", side.duo, side.rx, side.ix, side.at);
+			struct sidelog side = laneside(lane)[i];
+			printf(" %lx %x %x %x", side.duo, side.rx, side.ix, side.at);
 #endif
-		printf("\n");
+			printf("\n");
+		}
 	}
 }
 
 void keymap::checklog(unsigned flags = 1)
 {
 	static unsigned bebug = 0;
-	struct pmblock *log = microlog;
 
-	if (logtail & ~logmask)
-		error_exit(1, "%u: logtail out of range", bebug);
+	for (unsigned lx = 0; lx < loglanes; lx++) {
+		struct loglane &lane = lanes[lx];
 
-	if (loghead & ~logmask)
-		error_exit(1, "%u: loghead out of range", bebug);
+		if (lane.tail & ~logmask)
+			error_exit(1, "%u: lane %u tail out of range", bebug, lx);
 
-	if (flags & 1)
-		for (int i = loghead, j = logtail; i != j; i = (i + 1) & logmask) {
-			struct pmblock pmb;
-			log_read(&pmb, log, i);
+		if (lane.head & ~logmask)
+			error_exit(1, "%u: lane %u head out of range", bebug, lx);
 
-			struct delete_logent entry;
-			memcpy(&entry, &pmb, sizeof entry);
+		if (flags & 1)
+			for (unsigned i = lane.head, j = lane.tail; i != j; i = (i + 1) & logmask) {
+				struct pmblock pmb;
+				log_read(&pmb, lanelog(lane), i);
+
+				struct delete_logent entry;
+				memcpy(&entry, &pmb, sizeof entry);
 #ifdef SIDELOG
-			struct sidelog *sidelog = (struct sidelog *)Private;
-			struct sidelog side = sidelog[i];
+				struct sidelog side = laneside(lane)[i];
 
-			if (entry.logtype == 1) {
-				if (entry.duo != side.duo)
-					goto corrupt;
-			}
+				if (entry.logtype == 1) {
+					if (entry.duo != side.duo)
+						goto corrupt;
+				}
 #endif
-		}
+			}
+	}
 
 	bebug++;
 	return;
@@ -1178,72 +2701,284 @@ corrupt:
 #endif
 }
 
-int keymap::unify()
-{
-	enum {verify = 0};
+/*
+ * Unify retires a batch of logged updates: index cells go to their media
+ * fifos, the sink block and changed count lines are written back, then a
+ * unify entry is logged in every lane. Each lane ring is used in halves.
+ *
+ * A lane triggers unify when its half ring is one short of full, so a
+ * batch is at most half a lane ring, the last slot kept for the unify entry.
+ *
+ * Lanes are merged without regard to order between them: an entry names the
+ * fifo position (ix, at) its cell goes to, taken from the count map when
+ * logged, so every entry of a batch writes a distinct position and applying
+ * lanes in any order gives the same fifos. There is no log replay yet, so
+ * this ordering freedom is only relied on by unify itself.
+ *
+ * Unify seals the half being filled in the foreground, which is cheap, and
+ * an io task on the maintenance pool does the media writes while inserts go
+ * on filling the other half. The foreground waits only if the task has not
+ * finished the previous half by the time the next one fills, or when it
+ * touches media that the batch in flight still owns, and runs the task
+ * itself if no worker has started it. See unify_wait callers.
+ */
 
-	struct pmblock *log = microlog;
-	trace("[%u] %i %i", id, loghead, burst());
+/* Make earlier stores to mapped media durable, per backend */
+void keymap::persist(const void *mem, u64 len)
+{
+	if (pmconfig.backend == pm_pagecache) {
+		uintptr_t start = (uintptr_t)mem & -(uintptr_t)PAGE_SIZE;
+		_mm_sfence(); // streaming stores reach the page before msync reads it
+		if (msync((void *)start, (uintptr_t)mem + len - start, MS_SYNC))
+			warn("msync failed (%s)", strerror(errno));
+	}
+	sfence();
+}
 
-	for (int i = loghead, j = logtail; i != j; i = (i + 1) & logmask) {
-#ifdef SIDELOG
-		struct sidelog *sidelog = (struct sidelog *)Private;
-		struct sidelog side = sidelog[i];
-		if (verify) {
-			struct pmblock block;
-			struct delete_logent entry;
-			log_read(&block, log, i);
-			memcpy(&entry, &block, sizeof entry); // stupid, but strict aliasing requires this!
-			assert(sidelog[i].duo == entry.duo);
+/*
+ * Flatten shards over fifos that recovery may still trust, see struct
+ * shadow. Shards whose image does not fit in the spare stride, or whose
+ * new count is the same as the durable one, so that recovery could not
+ * tell the fifos apart, wait for a later unify and leave the list. With
+ * no durability there is nothing to recover, so in place.
+ */
+void keymap::shadow_flatten(std::vector<struct shard *> &flat)
+{
+	std::vector<struct shard *> fits;
+	for (struct shard *shard: flat) {
+		trace("flatten %u:%u media %u entries %u", shard->tx, shard->ix, shard->mediacount(), shard->count);
+		if (pmconfig.backend == pm_volatile) {
+			shard->flatten();
+			fits.push_back(shard);
+			continue;
 		}
-		assert(tiers[side.rx].shardmap);
-		if (1)
-			tiers[side.rx].store(side.ix, side.at, side.duo);
-#else
-		struct pmblock block;
-		struct insert_logent entry;
-		log_read(&block, log, i);
-		memcpy(&entry, &block, sizeof entry); // stupid or not, strict aliasing requires this!
-		hashkey_t hash;
-		loc_t loc;
-		duo_unpack(&tiers[entry.ix].duo, entry.duo, hash, loc);
+		struct tier &tier = tiers[shard->tx];
+		unsigned at = tier.shadowed ? : 1, cells = 1 + shard->count + 1;
+		if (at + cells > power2(tier.stridebits - cellshift) || tier.countmap[shard->ix] == shard->count + 1)
+			continue;
+		timed timer(timing, time_flatten);
+		count(stat_flatten);
+		struct shadow shadow = {shard->ix, shard->count + 1};
+		pmwrite(tier.spare() + at, &shadow, sizeof shadow);
+		shard->mediacount() = shard->image(tier.spare() + at + 1);
+		tier.dirty(shard->ix);
+		tier.shadowed = at + cells;
+		struct shadowtag tag;
+		memcpy(&tag, tier.spare(), sizeof tag);
+		tag = {{'f', 'l', 'a', 't'}, at == 1 ? 1 : tag.images + 1};
+		pmwrite(tier.spare(), &tag, sizeof tag);
+		fits.push_back(shard);
+	}
+	flat.swap(fits);
+}
 
-//		trace("%i: '%s' => %i:%u %.16lx @%i", i,
-//			cprinz(&block + sizeof entry, entry.head.len),
-		trace("%i: %.16lx @%i", i, hash, entry.at);
-		if (1)
-			tiers[entry.ix].store(entry.ix, entry.at, entry.duo);
-		if (0)
-			hexdump(&entry, linesize);
-#endif
+/*
+ * Unify side of shadow_flatten: images durable before the counts that
+ * select them, then copied over their fifos once the counts are durable.
+ */
+void keymap::shadow_images(bool counted)
+{
+	for (struct tier *tier: {upper, lower}) {
+		if (!tier->shadowed)
+			continue;
+		if (!counted) {
+			persist(tier->spare(), power2(cellshift, tier->shadowed));
+			continue;
+		}
+		struct shadowtag tag;
+		memcpy(&tag, tier->spare(), sizeof tag);
+		cell_t *cell = tier->spare() + 1;
+		for (unsigned i = 0; i < tag.images; i++) {
+			struct shadow shadow;
+			memcpy(&shadow, cell, sizeof shadow);
+			pmwrite(tier->at(shadow.ix, 0), cell + 1, power2(cellshift, shadow.count));
+			persist(tier->at(shadow.ix, 0), power2(cellshift, shadow.count));
+			cell += 1 + shadow.count;
+		}
+		tag.images = 0;
+		pmwrite(tier->spare(), &tag, sizeof tag);
+		persist(tier->spare(), sizeof tag);
+		tier->shadowed = 0;
 	}
+}
 
-	unsigned dirtylen = blocksize;
-	trace_off("append %i bytes", dirtylen);
-	assert(dirtylen <= blocksize);
+/* Synchronous unify, everything logged so far is in media on return */
+int keymap::unify()
+{
+	unify_begin();
+	unify_wait();
+	return 0;
+}
 
-	if (1) {
-		struct unify_logent unify = {};
-		log_commit(microlog, &unify, sizeof unify, &logtail);
+/*
+ * Wait for any batch in flight to reach media, returning true if there
+ * was one still working. Must precede anything that rewrites media fifos
+ * or relies on count map contents, and any access to the sink block of
+ * the batch in flight, which ext_bigmap_mem does.
+ */
+bool keymap::unify_wait()
+{
+	timed timer(timing, time_unify_wait);
+	bool waited = 0;
+	if (flusher && background_unify)
+		waited = maint().wait(flusher->task);
+	flushing = -1;
+	return waited;
+}
+
+/* Seal the log entries since the last unify into a batch and start it */
+void keymap::unify_begin()
+{
+	timed timer(timing, time_unify_begin);
+	if (!flusher)
+		flusher = new struct flusher(this);
+	if (unify_wait()) {
+		flusher->stalls++;
+		count(stat_stalls);
 	}
+	struct flusher &batch = *flusher;
+	trace("[%u] %u", id, burst());
+	write_super();
 
-	if (1)
-		pmwrite(rbspace + power2(blockbits, path[0].map.loc), path[0].map.data, dirtylen + (-dirtylen & linemask));
-	if (1)
-		pmwrite(upper->countmap, upper->countbuf, upper->shards() << countshift);
+#ifdef SIDELOG
+	/*
+	 * Rewrite any media fifo that churn has filled with dead cells, keeping
+	 * fifo length and replay time at populate proportional to live entries.
+	 * Flatten writes the whole fifo from the shard table, so batch cells of
+	 * a flattened shard are stale and must not be stored after it.
+	 */
+	std::vector<struct shard *> flat;
+	for (unsigned lx = 0; lx < loglanes; lx++) {
+		struct loglane &lane = lanes[lx];
+		for (unsigned i = lane.head, j = lane.tail; i != j; i = (i + 1) & logmask) {
+			struct sidelog side = laneside(lane)[i];
+			struct tier &tier = tiers[side.rx];
+			struct shard *shard = map[side.ix << tiershift(tier)];
+			if (shard && shard->tx == side.rx && shard->ix == side.ix && shard->is_bloated()) {
+				if (std::find(flat.begin(), flat.end(), shard) == flat.end())
+					flat.push_back(shard);
+			}
+		}
+	}
+	shadow_flatten(flat);
+	for (unsigned lx = 0; flat.size() && lx < loglanes; lx++) {
+		struct loglane &lane = lanes[lx];
+		for (unsigned i = lane.head, j = lane.tail; i != j; i = (i + 1) & logmask)
+			for (struct shard *shard: flat)
+				if (shard->tx == laneside(lane)[i].rx && shard->ix == laneside(lane)[i].ix)
+					laneside(lane)[i].flags |= sidelog::flattened;
+	}
+#endif
 
-	if (0) {
-		for (unsigned i = 0, n = std::min(upper->shards(), 50U); i < n; i++)
-			if (upper->countbuf[i]) {
-				printf("%i:\n", i);
-				hexdump(upper->shardmap + power2(upper->stridebits - cellshift, i), power2(cellshift, upper->countbuf[i] + 1));
+	batch.spans.clear();
+	for (unsigned lx = 0; lx < loglanes; lx++) {
+		struct loglane &lane = lanes[lx];
+		batch.spans.push_back({lane.head, lane.tail});
+		lane.tail = (lane.tail + 1) & logmask; // reserved for unify entry
+		lane.head = lane.tail;
+	}
+	batch.loc = flushing = path[0].map.loc;
+	memcpy(batch.block, path[0].map.data, blocksize);
+	batch.counts.clear();
+	for (struct tier *tier: {upper, lower})
+		if (!tier->is_empty())
+			tier->stage_counts(batch.counts);
+	batch.frames.clear();
+	if (pool)
+		pool->take_dirty(batch.frames);
+	batch.batches++;
+
+	if (!background_unify) {
+		unify_batch(batch);
+		return;
+	}
+	maint().submit(batch.task);
+}
+
+/*
+ * Media writes for a sealed batch. Runs as the flusher task, on a pool
+ * worker or a waiting foreground, so touches nothing but the sealed log
+ * entries, media and the batch itself.
+ */
+void keymap::unify_batch(struct flusher &batch)
+{
+	enum {verify = 0};
+	timed timer(timing, time_unify_batch); // flusher is the only writer of this one
+
+	for (unsigned lx = 0; lx < loglanes; lx++) {
+		struct pmblock *log = lanelog(lanes[lx]);
+		for (unsigned i = batch.spans[lx].first, j = batch.spans[lx].second; i != j; i = (i + 1) & logmask) {
+#ifdef SIDELOG
+			struct sidelog side = laneside(lanes[lx])[i];
+			if (verify) {
+				struct pmblock block;
+				struct delete_logent entry;
+				log_read(&block, log, i);
+				memcpy(&entry, &block, sizeof entry); // stupid, but strict aliasing requires this!
+				assert(side.duo == entry.duo);
 			}
+			assert(tiers[side.rx].shardmap);
+			if (side.flags & sidelog::flattened)
+				continue;
+			if (1)
+				tiers[side.rx].store(side.ix, side.at, side.duo);
+#else
+			struct pmblock block;
+			struct insert_logent entry;
+			log_read(&block, log, i);
+			memcpy(&entry, &block, sizeof entry); // stupid or not, strict aliasing requires this!
+			hashkey_t hash;
+			loc_t loc;
+			duo_unpack(&tiers[entry.ix].duo, entry.duo, hash, loc);
+
+//		trace("%i: '%s' => %i:%u %.16lx @%i", i,
+//			cprinz(&block + sizeof entry, entry.head.len),
+			trace("%i: %.16lx @%i", i, hash, entry.at);
+			if (1)
+				tiers[entry.ix].store(entry.ix, entry.at, entry.duo);
+			if (0)
+				hexdump(&entry, linesize);
+#endif
+		}
 	}
 
+	/*
+	 * Write back only sink lines that differ from media, since record
+	 * creates move records around when they reuse holes, and only count
+	 * lines marked dirty, for both tiers. Count lines go first, so with a
+	 * block pool the one fsync that ends its write batch is the barrier
+	 * for them and the media cells too, which reach the file through the
+	 * map. They are not ring writes: a count line is smaller than O_DIRECT
+	 * allows and is already in the page cache.
+	 */
+	shadow_images(0);
+	for (struct countline &line: batch.counts)
+		pmwrite(line.to, line.data, linesize);
+	unsigned written = batch.counts.size() * linesize;
+	if (pool) {
+		pool->write_back(batch.frames, pmconfig.backend != pm_volatile, batch.loc, batch.block);
+		written += blocksize;
+	} else
+		written += pmwrite_changed(rbspace + power2(blockbits, batch.loc), batch.block, blocksize);
+	trace_off("wrote %u bytes", written);
+	count(stat_unifies);
+	count(stat_unify_bytes, written);
+
 	sfence();
+	if (pmconfig.backend == pm_pagecache && !pool) {
+		int err = layout.sync(); // includes direct record updates since last unify
+		if (err)
+			warn("msync failed (%s)", strerror(-err));
+	}
 
-	loghead = logtail;
-	return 0;
+	shadow_images(1);
+
+	/* log unify only once everything it covers is durable */
+	for (unsigned lx = 0; lx < loglanes; lx++) {
+		struct unify_logent unify = {};
+		unsigned at = batch.spans[lx].second;
+		log_commit(lanelog(lanes[lx]), logorder, &unify, sizeof unify, &at);
+	}
 }
 
 enum {verify = 0};
@@ -1251,7 +2986,9 @@ enum {verify = 0};
 rec_t *keymap::insert(const void *key, unsigned keylen, const void *newrec, bool unique)
 {
 	assert(sizeof(struct insert_logent) == 24);
+	timed timer(timing, time_insert);
 
+	keep_budget();
 	cell_t hash = keyhash(key, keylen) & keymask;
 	trace("insert %s => %lx", cprinz((const char *)key, keylen), hash);
 	struct shard *shard = getshard(hash >> sigbits, 1);
@@ -1259,16 +2996,21 @@ rec_t *keymap::insert(const void *key, unsigned keylen, const void *newrec, bool
 	if (unique && shard->lookup(key, keylen, hash))
 		return (rec_t *)errwrap(-EEXIST);
 
-	if (1 && burst() == logsize - 1) { // one slot reserved for unify
+	struct loglane &lane = this->lane();
+	if (1 && burst(lane) == logbatch - 1) { // one slot reserved for unify
 		trace("log limit --> unify");
-		unify();
+		unify_begin();
 	}
 
 	while (1) {
 		struct recinfo &ri = sinkinfo();
 		if (verify)
 			assert(!recops.check(&ri));
-		rec_t *rec = (recops.create)(&ri, key, keylen, hash, newrec, 0);
+		rec_t *rec;
+		{
+			timed timer(timing, time_create);
+			rec = (recops.create)(&ri, key, keylen, hash, newrec, 0);
+		}
 		if (!is_errcode(rec)) {
 			loc_t loc = path[0].map.loc;
 			/*
@@ -1285,6 +3027,7 @@ rec_t *keymap::insert(const void *key, unsigned keylen, const void *newrec, bool
 			struct tier &tier = tiers[tx];
 			cell_t duo = duo_pack(&tier.duo, hash & bitmask(sigbits), loc);
 			unsigned at = tier.countbuf[ix]++, ax = tx ^ (upper - tiers);
+			tier.dirty(ix);
 
 			struct insert_logent head = { // this usage requires c++17
 				{ .logtype = 1, .ax = ax, .ix = ix, .at = at, .duo = duo },
@@ -1296,12 +3039,12 @@ rec_t *keymap::insert(const void *key, unsigned keylen, const void *newrec, bool
 			memcpy(logent + sizeof head + reclen, key, keylen);
 			unsigned size = sizeof head + reclen + keylen;
 #ifdef SIDELOG
-			struct sidelog *sidelog = (struct sidelog *)Private;
-			sidelog[logtail] = (struct sidelog){ .duo = duo, .at = at, .ix = ix, .rx = tx };
+			laneside(lane)[lane.tail] = (struct sidelog){ .duo = duo, .at = at, .ix = ix, .rx = tx };
 #endif
-			log_commit(microlog, logent, size, &logtail);
+			log_commit(lanelog(lane), logorder, logent, size, &lane.tail);
 			if (0)
 				checklog(0);
+			count(stat_inserts);
 			return rec;
 		}
 
@@ -1314,9 +3057,11 @@ rec_t *keymap::insert(const void *key, unsigned keylen, const void *newrec, bool
 
 		if (burst()) {
 			trace("block full --> unify");
-			unify();
+			unify_begin();
 		}
 
+		timed timer(timing, time_bigmap_try);
+		count(stat_bigmap_try);
 		if (bigmap_try(this, keylen, recops.big(&ri)) == 1)
 			recops.init(&ri);
 	}
@@ -1324,29 +3069,49 @@ rec_t *keymap::insert(const void *key, unsigned keylen, const void *newrec, bool
 
 int keymap::remove(const void *key, unsigned len)
 {
+	enum {compact_interval = 256, compact_budget = 16};
+
 	trace("delete '%.*s'", len, (const char *)key);
+	timed timer(timing, time_remove);
+	keep_budget();
 	hashkey_t hash = keyhash((const u8 *)key, len) & keymask;
-	return getshard(hash >> sigbits, 1)->remove(key, len, hash); // wrong! could create a shard just to remove a nonexistent entry
+
+	if (burst(lane()) == logbatch - 1) { // one slot reserved for unify
+		trace("log limit --> unify");
+		unify_begin();
+	}
+
+	int err = getshard(hash >> sigbits, 1)->remove(key, len, hash); // wrong! could create a shard just to remove a nonexistent entry
+	if (!err)
+		count(stat_removes);
+	if (!err && ++churn == compact_interval) {
+		churn = 0;
+		compact(compact_budget);
+	}
+	return err;
 }
 
-int shard::remove(const void *key, unsigned len, hashkey_t hash)
+int shard::remove(const void *key, unsigned len, hashkey_t hash, loc_t only)
 {
 	cell_t lowkey = hash & bitmask(lowbits);
 	unsigned link = (hash >> lowbits) & bitmask(tablebits);
 	loc_t loc;
 
 	if (bucket_used(link)) {
-		tests++;
+		map->count(stat_buckets);
 		do {
 			const cell_t &entry = table[link].key_loc_link;
-			if (tri_third(&tri, entry) == lowkey) {
+			map->count(stat_chain);
+			if (tri_third(&tri, entry) == lowkey && (only == (loc_t)-1 || tri_second(&tri, entry) == only)) {
 				loc = tri_second(&tri, entry);
 				trace("probe block %x", loc);
-				probes++;
+				map->count(stat_probes);
 				struct recinfo ri = map->peekinfo(loc);
 				int err = map->recops.remove(&ri, key, len, hash);
 				if (!err) {
 					trace("delete %i/%i, big = %i", loc, len, map->recops.big(&ri));
+					if (map->pool)
+						map->pool->mark(loc);
 					if (remove(hash, loc) == -ENOENT)
 						break;
 					bigmap_free(map, loc, map->recops.big(&ri));
@@ -1363,15 +3128,1099 @@ logging:
 	struct tier &tier = map->tiers[tx];
 	cell_t duo = duo_pack(&tier.duo, hash & bitmask(map->sigbits), loc) | high64;
 	unsigned at = tier.countbuf[ix]++, ax = tx ^ (map->upper - map->tiers);
+	tier.dirty(ix);
 	struct delete_logent head = { .logtype = 2, .ax = ax, .ix = ix, .at = at, .duo = duo };
+	struct loglane &lane = map->lane();
 #ifdef SIDELOG
-	struct sidelog *sidelog = (struct sidelog *)map->Private;
-	sidelog[map->logtail] = (struct sidelog){.duo = duo, .at = at, .ix = ix, .rx = tx};
+	map->laneside(lane)[lane.tail] = (struct sidelog){.duo = duo, .at = at, .ix = ix, .rx = tx};
 #endif
-	log_commit(map->microlog, &head, sizeof head, &map->logtail); // uninitialized at end!
+	log_commit(map->lanelog(lane), map->logorder, &head, sizeof head, &lane.tail); // uninitialized at end!
+	return 0;
+}
+
+/* Latency timing */
+
+static u64 monotonic_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* Tsc rate against the monotonic clock over a short busy wait */
+static double tsc_per_ns()
+{
+	enum {calibrate_ns = 10000000};
+	u64 ns = monotonic_ns(), tsc = __rdtsc(), elapsed;
+	while ((elapsed = monotonic_ns() - ns) < calibrate_ns)
+		;
+	return (double)(__rdtsc() - tsc) / elapsed;
+}
+
+/* Enable latency histograms, starting empty, or disable and drop them */
+void keymap::set_timing(bool enable)
+{
+	unify_wait(); // flusher may be recording
+	free(timing);
+	timing = NULL;
+	if (enable) {
+		timing = (struct timing *)calloc(1, sizeof *timing);
+		timing->cycles_per_ns = tsc_per_ns();
+	}
+}
+
+const struct histogram *keymap::histogram(enum timed_event what) const
+{
+	return timing ? timing->event + what : NULL;
+}
+
+void keymap::dump_timing()
+{
+	if (!timing)
+		return;
+	unify_wait();
+	double scale = timing->cycles_per_ns * 1000;
+	printf("[%u] latency us, tsc %.3f GHz\n", id, timing->cycles_per_ns);
+	for (unsigned i = 0; i < timed_events; i++) {
+		const struct histogram &hist = timing->event[i];
+		if (!hist.samples)
+			continue;
+		printf("%-12s %9lu mean %9.2f p50 %9.2f p99 %9.2f p999 %9.2f max %9.2f\n",
+			timed_event_name[i], hist.samples, hist.total / scale / hist.samples,
+			hist.percentile(0.5) / scale, hist.percentile(0.99) / scale,
+			hist.percentile(0.999) / scale, hist.max / scale);
+	}
+}
+
+/* Event counters */
+
+void keymap::count(enum stat_counter what, u64 n)
+{
+	statslots[thread_index() % statslots_max].counter[what].fetch_add(n, std::memory_order_relaxed);
+}
+
+/*
+ * Sum the counter slots and survey resident shards. Walking record blocks
+ * for hole space reads every block, so only on request.
+ */
+struct keystats keymap::stats(bool walk)
+{
+	struct keystats stats = {};
+	unify_wait();
+	for (unsigned i = 0; i < statslots_max; i++)
+		for (unsigned j = 0; j < stat_counters; j++)
+			stats.counter[j] += statslots[i].counter[j].load(std::memory_order_relaxed);
+	stats.counter[stat_bigmap_scan] = scanned;
+
+	stats.shards = upper->shards() + (single_tier() ? 0 : lower->shards());
+	for (unsigned i = 0; i < shards; i++) {
+		struct shard *shard = map[i];
+		if (!shard || i != shard->ix << tiershift(tier(shard)))
+			continue; // lower tier shards cover several map entries
+		stats.resident++;
+		stats.entries += shard->count;
+		stats.fill[std::min(shard->count * keystats::fill_bins / shard->limit, keystats::fill_bins - 1u)]++;
+	}
+
+	if ((stats.walked = walk)) {
+		for (loc_t loc = 0; loc < blocks; loc++) {
+			if (is_maploc(loc, blockbits))
+				continue;
+			struct recinfo ri = {blocksize, reclen, loc == path[0].map.loc ? path[0].map.data : blockdata(loc), loc, this};
+			stats.blocks++;
+			stats.hole_bytes += recops.waste(&ri);
+		}
+	}
+	return stats;
+}
+
+std::string keymap::stats_json(bool walk)
+{
+	struct keystats stats = this->stats(walk);
+	u64 *counter = stats.counter;
+	char buf[200];
+	std::string json = "{";
+	for (unsigned i = 0; i < stat_counters; i++) {
+		snprintf(buf, sizeof buf, "\"%s\": %lu, ", stat_counter_name[i], counter[i]);
+		json += buf;
+	}
+	auto ratio = [](u64 a, u64 b) { return b ? (double)a / b : 0.0; };
+	snprintf(buf, sizeof buf, "\"probes_per_bucket\": %.3f, \"chain_per_bucket\": %.3f, \"scan_per_try\": %.1f, ",
+		ratio(counter[stat_probes], counter[stat_buckets]), ratio(counter[stat_chain], counter[stat_buckets]),
+		ratio(counter[stat_bigmap_scan], counter[stat_bigmap_try]));
+	json += buf;
+	snprintf(buf, sizeof buf, "\"shards\": %lu, \"resident\": %lu, \"entries\": %lu, \"fill\": [",
+		stats.shards, stats.resident, stats.entries);
+	json += buf;
+	for (unsigned i = 0; i < keystats::fill_bins; i++) {
+		snprintf(buf, sizeof buf, "%s%lu", i ? ", " : "", stats.fill[i]);
+		json += buf;
+	}
+	json += "]";
+	if (stats.walked) {
+		snprintf(buf, sizeof buf, ", \"blocks\": %lu, \"hole_bytes\": %lu", stats.blocks, stats.hole_bytes);
+		json += buf;
+	}
+	return json + "}";
+}
+
+/* Offline inspection */
+
+void inspection::add(const struct inspection &more)
+{
+	for (unsigned tx = 0; tx < 2; tx++) {
+		fifos[tx].shards += more.fifos[tx].shards;
+		fifos[tx].entries += more.fifos[tx].entries;
+		fifos[tx].tombstones += more.fifos[tx].tombstones;
+		fifos[tx].longest = std::max(fifos[tx].longest, more.fifos[tx].longest);
+		for (unsigned i = 0; i < fifo_bins; i++)
+			fifos[tx].log2[i] += more.fifos[tx].log2[i];
+	}
+	buckets += more.buckets;
+	for (unsigned i = 0; i < chain_bins; i++)
+		chain[i] += more.chain[i];
+	blocks += more.blocks;
+	maps += more.maps;
+	bad += more.bad;
+	records += more.records;
+	holes += more.holes;
+	hole_bytes += more.hole_bytes;
+	gap_bytes += more.gap_bytes;
+	for (unsigned i = 0; i < fill_bins; i++)
+		fill[i] += more.fill[i];
+}
+
+/*
+ * Survey media of a read only keymap: fifo length and tombstones of each
+ * shard, bucket chains of each shard as populate would build it, fill and
+ * holes of each record block, and bigmap slack. Shards and runs of blocks
+ * are shared out to threads, each summing privately. Shard construction
+ * takes a lock for the table allocator, loading from media does not.
+ */
+void keymap::inspect(struct inspection &out, unsigned threads)
+{
+	enum {blocks_per_job = 1024};
+	struct tier *const tier[2] = {upper, lower};
+	unsigned shardjobs[2] = {tier[0]->is_empty() ? 0 : tier[0]->shards(), tier[1]->is_empty() ? 0 : tier[1]->shards()};
+	u64 jobs = shardjobs[0] + shardjobs[1] + (blocks + blocks_per_job - 1) / blocks_per_job;
+	std::atomic<u64> next{0};
+	std::mutex lock;
+
+	out = {};
+	for (unsigned tx = 0; tx < 2; tx++) {
+		out.entries[tx].resize(shardjobs[tx]);
+		out.tombstones[tx].resize(shardjobs[tx]);
+	}
+
+	auto fifo = [&](struct inspection &own, unsigned tx, unsigned ix) {
+		unsigned n = tier[tx]->countbuf[ix];
+		if (!n)
+			return;
+		const cell_t *media = tier[tx]->fifo(ix, n);
+		unsigned tombstones = 0;
+		for (unsigned j = 1; j < n; j++)
+			tombstones += media[j] >> 63;
+		out.entries[tx][ix] = n - 1;
+		out.tombstones[tx][ix] = tombstones;
+		struct inspection::fifos &fifos = own.fifos[tx];
+		fifos.shards++;
+		fifos.entries += n - 1;
+		fifos.tombstones += tombstones;
+		fifos.longest = std::max(fifos.longest, (u64)n - 1);
+		fifos.log2[std::min(n > 1 ? 64 - __builtin_clzll(n - 1) : 0, inspection::fifo_bins - 1)]++;
+
+		/* table big enough for the whole fifo, as rehash would have made it */
+		unsigned bits = tablebits;
+		while (mul8(loadfactor, power2(bits)) < n && guess_linkbits(bits + 1, loadfactor) + cellshift <= tier[tx]->stridebits)
+			bits++;
+		struct shard *shard;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			shard = new_shard(tier[tx], ix << tiershift(*tier[tx]), bits, 0);
+		}
+		shard->load_from_media();
+		for (unsigned bucket = 0; bucket < shard->buckets(); bucket++) {
+			unsigned chain = 0;
+			if (shard->bucket_used(bucket))
+				for (unsigned link = bucket; link != shard::endlist; link = shard->next_entry(link))
+					chain++;
+			own.chain[std::min(chain, inspection::chain_bins - 1u)]++;
+			own.buckets++;
+		}
+		std::lock_guard<std::mutex> guard(lock);
+		delete shard;
+	};
+
+	auto records = [&](struct inspection &own, loc_t start, loc_t end) {
+		for (loc_t loc = start; loc < end; loc++) {
+			if (is_maploc(loc, blockbits)) {
+				own.maps++;
+				continue;
+			}
+			struct recinfo ri = {blocksize, reclen, rbspace + power2(blockbits, loc), loc, this};
+			struct rb *rb = (struct rb *)ri.data;
+			if (memcmp(rb->magic, "RB", 2) || recops.check(&ri)) {
+				warn("bad record block %u", loc);
+				own.bad++;
+				continue;
+			}
+			unsigned waste = recops.waste(&ri), gap = recops.more(&ri) - rb->free;
+			own.blocks++;
+			own.records += rb->count - rb->holes;
+			own.holes += rb->holes;
+			own.hole_bytes += waste;
+			own.gap_bytes += gap;
+			own.fill[std::min((blocksize - gap - waste) * inspection::fill_bins / blocksize, inspection::fill_bins - 1u)]++;
+		}
+	};
+
+	auto work = [&]() {
+		struct inspection own = {};
+		for (u64 job; (job = next++) < jobs;) {
+			if (job < shardjobs[0])
+				fifo(own, 0, job);
+			else if ((job -= shardjobs[0]) < shardjobs[1])
+				fifo(own, 1, job);
+			else {
+				loc_t start = (job - shardjobs[1]) * blocks_per_job;
+				records(own, start, std::min(start + (loc_t)blocks_per_job, blocks));
+			}
+		}
+		std::lock_guard<std::mutex> guard(lock);
+		out.add(own);
+	};
+
+	std::vector<std::thread> workers;
+	for (unsigned i = 1; i < threads; i++)
+		workers.emplace_back(work);
+	work();
+	for (std::thread &worker: workers)
+		worker.join();
+	out.slack = bigmap_check(this);
+}
+
+/* Full table scan */
+
+/*
+ * Record block contents by location without disturbing peek state, so
+ * safe to call from several scan threads at once.
+ */
+u8 *keymap::blockdata(loc_t loc)
+{
+	return loc == path[0].map.loc ? path[0].map.data : ext_bigmap_mem(this, loc);
+}
+
+/* Block io for front buffers, by file map or block pool */
+
+void keymap::read_block(loc_t loc, u8 *buf)
+{
+	if (loc == flushing)
+		unify_wait();
+	if (pool)
+		pool->read(loc, buf);
+	else
+		memcpy(buf, rbspace + power2(blockbits, loc), blocksize);
+}
+
+void keymap::write_block(loc_t loc, u8 *buf)
+{
+	if (pool)
+		pool->write(loc, buf);
+	else
+		pmwrite(rbspace + power2(blockbits, loc), buf, blocksize);
+}
+
+/*
+ * Serve record blocks from a pool of frames by explicit io instead of the
+ * file map, optionally bypassing the page cache. Falls back to cached io
+ * where the file system refuses O_DIRECT.
+ */
+int keymap::set_pool(unsigned blocks, bool direct)
+{
+	if (pool)
+		return -EBUSY;
+	if (blocks < 2 * blockpool::recent_pins)
+		return -EINVAL;
+	unify_wait();
+	int iofd = -1;
+	if (direct) {
+		char path[40];
+		snprintf(path, sizeof path, "/proc/self/fd/%i", fd);
+		if ((iofd = open(path, O_RDWR|O_DIRECT)) < 0)
+			warn("no direct io (%s)", strerror(errno));
+	}
+	if (iofd < 0 && (iofd = dup(fd)) < 0)
+		return -errno;
+	pool = new blockpool(iofd, rbspace_pos, blockbits, blocks);
 	return 0;
 }
 
+struct poolstats keymap::pool_stats()
+{
+	if (!pool)
+		return {};
+	std::lock_guard<std::mutex> guard(pool->lock);
+	return {pool->frames, pool->hits, pool->misses, pool->reads, pool->writes};
+}
+
+/*
+ * Note an in place change to a record returned by lookup. Pool frames are
+ * marked for write back at unify, mapped records are flushed per backend.
+ */
+/*
+ * Hold a record returned by lookup or insert across later operations on
+ * the table, until unpin. Only needed with a block pool, where the frame
+ * could otherwise be replaced under the pointer.
+ */
+void keymap::pin(const void *rec)
+{
+	if (pool && pool->owns(rec))
+		pool->pin(rec);
+}
+
+void keymap::unpin(const void *rec)
+{
+	if (pool && pool->owns(rec))
+		pool->put(rec);
+}
+
+void keymap::changed(const void *mem, unsigned len)
+{
+	if (pool && pool->owns(mem)) {
+		pool->mark_mem(mem);
+		return;
+	}
+	for (uintptr_t line = (uintptr_t)mem & ~linemask; line < (uintptr_t)mem + len; line += linesize)
+		clwb((void *)line);
+}
+
+void keymap::scan_range(const struct scanspec &spec, struct scansum &sum, loc_t start, loc_t end)
+{
+	enum {prefetch_blocks = 4, chunk_blocks = 16};
+
+	if (pool) {
+		/*
+		 * Read around the pool in large chunks so a scan neither waits on
+		 * single block reads nor washes out the cache, several chunks in
+		 * flight at once with io_uring. Resident frames are used instead,
+		 * being newer than media if dirty.
+		 */
+		enum {chunks = 8, window = chunks * chunk_blocks};
+		struct uring ring;
+		bool async = pool->async && !uring_open(&ring, chunks);
+		u8 *chunk = (u8 *)aligned_alloc(PAGE_SIZE, power2(blockbits, window));
+		for (loc_t at = start; at < end; at += window) {
+			unsigned n = std::min(end - at, (loc_t)window);
+			pool->read_extents(async ? &ring : NULL, at, chunk, n, chunk_blocks);
+			for (loc_t loc = at; loc < at + n; loc++) {
+				if (is_maploc(loc, blockbits))
+					continue;
+				u8 *frame = loc == path[0].map.loc ? NULL : pool->get_resident(loc);
+				u8 *data = loc == path[0].map.loc ? path[0].map.data :
+					frame ? frame : chunk + power2(blockbits, loc - at);
+				struct recinfo ri = {blocksize, reclen, data, loc, this};
+				recops.scan(&ri, &spec, &sum);
+				if (frame)
+					pool->put(frame);
+			}
+		}
+		if (async)
+			uring_close(&ring);
+		free(chunk);
+		return;
+	}
+
+	for (loc_t loc = start; loc < end; loc++) {
+		if (is_maploc(loc, blockbits))
+			continue;
+		if (loc + prefetch_blocks < end) {
+			/* table grows up from block base, records grow down from top */
+			u8 *ahead = blockdata(loc + prefetch_blocks);
+			__builtin_prefetch(ahead);
+			__builtin_prefetch(ahead + linesize);
+			__builtin_prefetch(ahead + blocksize - linesize);
+			__builtin_prefetch(ahead + blocksize - 2 * linesize);
+		}
+		struct recinfo ri = {blocksize, reclen, blockdata(loc), loc, this};
+		recops.scan(&ri, &spec, &sum);
+	}
+}
+
+/*
+ * Split the record block range evenly across worker threads, each applying
+ * the scan kernel to its own range, then combine partial sums. Zero threads
+ * means one per cpu. Caller must not modify the map during the scan.
+ * Returns -EINVAL for an unknown predicate or a field not inside the record.
+ */
+int keymap::scan(const struct scanspec &spec, struct scansum &total, unsigned threads)
+{
+	enum {min_blocks_per_thread = 64};
+
+	if ((unsigned)spec.where > scanspec::ge || (u64)spec.sum_at + sizeof(s64) > reclen ||
+			(spec.where != scanspec::all && (u64)spec.where_at + sizeof(s64) > reclen))
+		return -EINVAL;
+
+	timed timer(timing, time_scan);
+
+	if (!threads)
+		threads = std::max(std::thread::hardware_concurrency(), 1U);
+	threads = std::max(std::min(threads, blocks / min_blocks_per_thread), 1U);
+	unify_wait(); // so workers never wait on the sink block in flight
+
+	const struct scansum empty = {0, 0, 0, INT64_MAX, INT64_MIN};
+	std::vector<struct scansum> sums(threads, empty);
+	std::vector<std::thread> workers;
+	loc_t range = (blocks + threads - 1) / threads;
+
+	trace("scan %u blocks with %u threads", blocks, threads);
+	for (unsigned i = 1; i < threads; i++)
+		workers.emplace_back([this, &spec, &sums, i, range]() {
+			scan_range(spec, sums[i], i * range, std::min(blocks, (i + 1) * range));
+		});
+	scan_range(spec, sums[0], 0, std::min(blocks, range));
+
+	total = empty;
+	for (unsigned i = 0; i < threads; i++) {
+		if (i)
+			workers[i - 1].join();
+		total.records += sums[i].records;
+		total.matched += sums[i].matched;
+		total.sum += sums[i].sum;
+		total.min = std::min(total.min, sums[i].min);
+		total.max = std::max(total.max, sums[i].max);
+	}
+	return 0;
+}
+
+/* Record block compaction */
+
+/*
+ * Move the live records of a sparse block to the sink so the whole block
+ * can be reused. Each record is inserted again, then its old record and
+ * index entry are removed, both logged as for any insert and remove, so a
+ * crash in between leaves a duplicate, not a loss. Records are taken from
+ * a copy of the block. If the sink fills and bigmap picks the block being
+ * emptied as the next sink, the last record went back into it, the two
+ * copies are identical so removing either is right, and the rest stay.
+ * Returns records moved.
+ */
+unsigned keymap::merge(loc_t loc, u8 *scratch)
+{
+	struct moving { const void *key; unsigned len; const void *rec; };
+	std::vector<struct moving> live;
+	unsigned moved = 0;
+
+	struct recinfo ri = {blocksize, reclen, (u8 *)memcpy(scratch, blockdata(loc), blocksize), loc, this};
+	recops.walk(&ri, [](void *context, u8 *key, unsigned len, u8 *data, unsigned reclen) {
+		((std::vector<struct moving> *)context)->push_back({key, len, data});
+	}, &live);
+
+	for (struct moving &rec: live) {
+		hashkey_t hash = keyhash(rec.key, rec.len) & keymask;
+		insert(rec.key, rec.len, rec.rec, 0);
+		if (burst(lane()) == logbatch - 1) // one slot reserved for unify
+			unify_begin();
+		int err = getshard(hash >> sigbits, 1)->remove(rec.key, rec.len, hash, loc);
+		assert(!err);
+		if (path[0].map.loc == loc)
+			break;
+		moved++;
+	}
+	trace("merged %u of %zu records from block %u", moved, live.size(), loc);
+	return moved;
+}
+
+/*
+ * Incremental compaction, examining at most budget blocks per call from
+ * where the previous call left off, so cost is bounded and spread over
+ * the deletes that cause fragmentation. A block with at most a quarter of
+ * its space live is first emptied into the sink by merge, at most one per
+ * call since every record moved is logged. A block is rewritten when its
+ * holes waste at least 1/8 of the block. The sink is compacted in its front
+ * buffer and written by the next unify, other blocks are compacted in a
+ * scratch buffer and written back whole. Compaction alone does not move
+ * records between blocks, so index entries are unaffected. Bigmap learns
+ * the bigger free space as for delete, so emptied blocks are reused by
+ * later inserts. The block count is a high water mark and never shrinks.
+ */
+unsigned keymap::compact(unsigned budget)
+{
+	timed timer(timing, time_compact);
+	enum {waste_shift = 3, sparse_shift = 2, merge_max = 1};
+	unsigned compacted = 0, merged = 0;
+	u8 *scratch = NULL;
+
+	for (unsigned n = 0; n < budget; n++) {
+		loc_t loc = compact_at;
+		compact_at = loc + 1 < blocks ? loc + 1 : 0;
+		if (is_maploc(loc, blockbits))
+			continue;
+
+		struct recinfo ri = {blocksize, reclen, blockdata(loc), loc, this};
+		bool sink = loc == path[0].map.loc;
+		if (!sink && merged < merge_max && recops.more(&ri) >= (int)(blocksize - (blocksize >> sparse_shift))) {
+			if (!scratch)
+				scratch = (u8 *)aligned_alloc(linesize, blocksize);
+			if (merge(loc, scratch))
+				merged++;
+			sink = loc == path[0].map.loc;
+			ri.data = blockdata(loc);
+		}
+		if (recops.waste(&ri) < (blocksize >> waste_shift))
+			continue;
+
+		u8 *data = ri.data;
+		if (!sink) {
+			if (!scratch)
+				scratch = (u8 *)aligned_alloc(linesize, blocksize);
+			ri.data = (u8 *)memcpy(scratch, data, blocksize);
+		}
+		recops.compact(&ri);
+		if (!sink) {
+			pmwrite(data, scratch, blocksize);
+			if (pool)
+				pool->mark(loc);
+		}
+		bigmap_free(this, loc, recops.big(&ri));
+		compacted++;
+	}
+
+	if (scratch) {
+		sfence();
+		free(scratch);
+	}
+	count(stat_compact, compacted);
+	count(stat_merge, merged);
+	return compacted;
+}
+
+/* Bulk load */
+
+/*
+ * Load a fresh map from a stream of unique keys, with geometry already set
+ * by bulk_geometry. Records are packed into blocks sequentially and each
+ * block is written once when full. Index entries go straight into shards
+ * sized for the final load, without unique check or microlog, then each
+ * shard media fifo is written in one pass by flatten. If the size hint was
+ * too low and some shard fills, the rest of the stream takes the normal
+ * insert path. Returns number of records loaded.
+ */
+u64 keymap::bulk_load(bulk_source next)
+{
+	assert(!burst() && !upper->countbuf[0]);
+	const void *key, *data;
+	unsigned keylen;
+	bool more = 0;
+	u64 loaded = 0;
+
+	populate_all();
+	while (next(key, keylen, data)) {
+		hashkey_t hash = keyhash(key, keylen) & keymask;
+		struct shard *shard = map[hash >> sigbits];
+		if (shard->count == shard->limit) {
+			warn("*** bulk load size hint too low at %lu records", loaded);
+			more = 1;
+			break;
+		}
+
+		struct recinfo &ri = sinkinfo();
+		while (is_errcode(recops.create(&ri, key, keylen, hash, data, 0))) {
+			write_block(path[0].map.loc, path[0].map.data);
+			if (bigmap_try(this, keylen, recops.big(&ri)) == 1)
+				recops.init(&ri);
+		}
+		shard->insert(hash, path[0].map.loc);
+		loaded++;
+	}
+
+	unify_wait();
+	for (unsigned i = 0; i < shards; i++)
+		map[i]->flatten();
+	unify();
+
+	if (more) {
+		do {
+			insert(key, keylen, data, 0);
+			loaded++;
+		} while (next(key, keylen, data));
+	}
+	return loaded;
+}
+
+/* Hash order iteration */
+
+/*
+ * Cursor positions are left justified in the full keymap hash, which has the
+ * same width in every geometry. A shard entry knows only the shard index bits
+ * at the top and its tier significant bits at the bottom. Any bits between,
+ * lost when add_tier reduced precision, are zero, so entry positions within
+ * one shard are ordered like their tier relative hashes.
+ */
+static u64 knownbits(unsigned mapbits, unsigned sigbits, unsigned width)
+{
+	return (mapbits ? ~0ULL << (64 - mapbits) : 0) | bitmask(sigbits) << (64 - width);
+}
+
+static unsigned posindex(u64 pos, unsigned bits)
+{
+	return bits ? pos >> (64 - bits) : 0;
+}
+
+/*
+ * Return up to max index entries in hash order starting after the cursor
+ * position, resolving each entry to its record(s) by hashing the keys in the
+ * indexed block. Entries are collected a batch at a time and each block is
+ * walked once for all the batch entries that index it. Returns zero when
+ * iteration is complete.
+ *
+ * Like a hash order readdir cookie, the cursor stays valid across rehash,
+ * reshard and map growth. If the current geometry knows different hash bits
+ * than the one the cursor was saved in then iteration resumes inclusively
+ * below the highest bit no longer known, and the saved position becomes a
+ * bound that resolved records are compared against using their full hash,
+ * so no entry is missed or repeated. The bound is dropped once iteration
+ * passes the hash bits both geometries know above it. The cursor holds one
+ * bound, so if the geometry changes again before then, iteration fails with
+ * -EAGAIN rather than repeat entries, the cursor left at the last entry
+ * returned, and the caller must start over. That needs hash bits lost by
+ * add_tier, so is rare.
+ * The callback must not modify the map.
+ */
+int keymap::iterate(struct cursor &cursor, unsigned max, rb_walk_fn fn, void *context)
+{
+	struct entry { hashkey_t hash; loc_t loc; u64 pos; };
+	struct hit { unsigned entry; u8 *key, *data; unsigned keylen, reclen; };
+
+	struct resolve {
+		const struct entry *entries;
+		const unsigned *from, *to; // batch entries indexing this block, by hash
+		hashkey_t mask, keymask;
+		unsigned width;
+		u64 known, bound; // no bound if nothing known
+		loc_t loc;
+		std::vector<struct hit> *hits;
+	};
+
+	auto match = [](void *context, u8 *key, unsigned keylen, u8 *data, unsigned reclen) {
+		struct resolve *resolve = (struct resolve *)context;
+		hashkey_t hash = keyhash(key, keylen) & resolve->keymask;
+		const struct entry *entries = resolve->entries;
+		auto which = std::lower_bound(resolve->from, resolve->to, hash & resolve->mask,
+			[entries](unsigned i, hashkey_t hash) { return entries[i].hash < hash; });
+		if (which == resolve->to || entries[*which].hash != (hash & resolve->mask))
+			return;
+		if (resolve->known) {
+			u64 was = hash << (64 - resolve->width) & resolve->known;
+			if (was < resolve->bound || (was == resolve->bound && entries[*which].loc <= resolve->loc))
+				return; // returned before geometry change
+		}
+		resolve->hits->push_back({*which, key, data, keylen, reclen});
+	};
+
+	if (cursor.state == cursor::done)
+		return 0;
+
+	bool fresh = cursor.state == cursor::fresh;
+	unsigned width = upper->mapbits + sigbits, found = 0;
+	u64 from = fresh ? 0 : cursor.pos, known = knownbits(cursor.mapbits, cursor.sigbits, width);
+	u64 bound = cursor.bound, boundbits = fresh ? 0 : knownbits(cursor.boundmap, cursor.boundsig, width);
+	u8 boundmap = cursor.boundmap, boundsig = cursor.boundsig;
+	loc_t fromloc = cursor.loc, boundloc = cursor.boundloc;
+	std::vector<std::pair<hashkey_t, loc_t>> bucket;
+	std::vector<struct entry> batch;
+	std::vector<unsigned> order;
+	std::vector<struct hit> hits;
+
+	for (unsigned i = posindex(from, upper->mapbits); i < shards;) {
+		struct shard *shard = getshard(i, 0);
+		if (!shard) {
+			i++;
+			continue;
+		}
+
+		const struct tier &tier = shard->tier();
+		unsigned ix = shard->ix, first = 0;
+		unsigned shift = sigbits + tiershift(tier); // shard index position in full hash
+		u64 base = tier.mapbits ? (u64)ix << (64 - tier.mapbits) : 0;
+		u64 shardbits = knownbits(tier.mapbits, tier.sigbits, width), lost = known & ~shardbits;
+		u64 start = fresh || !lost ? from : from & ~(~0ULL >> __builtin_clzll(lost));
+		bool inclusive = !fresh && known != shardbits;
+
+		if (boundbits) {
+			u64 differ = boundbits ^ shardbits;
+			u64 above = differ ? ~0ULL << 1 << (63 - __builtin_clzll(differ)) : ~0ULL;
+			if ((std::max(start, base) & above) > (bound & above))
+				bound = boundbits = boundmap = boundsig = boundloc = 0; // nothing ahead is below it
+		}
+
+		if (inclusive && (bound != from || boundbits != known)) {
+			if (boundbits)
+				return found ? found : -EAGAIN;
+			bound = from, boundbits = known, boundloc = fromloc;
+			boundmap = cursor.mapbits, boundsig = cursor.sigbits;
+		}
+
+		if (!fresh && posindex(start, tier.mapbits) == ix)
+			first = (start >> (64 - width) & bitmask(tier.sigbits)) >> shard->lowbits;
+
+		auto flush = [&]() {
+			order.resize(batch.size());
+			for (unsigned j = 0; j < batch.size(); j++)
+				order[j] = j;
+			std::sort(order.begin(), order.end(), [&batch](unsigned a, unsigned b) {
+				return batch[a].loc < batch[b].loc || (batch[a].loc == batch[b].loc && batch[a].hash < batch[b].hash); });
+
+			hits.clear();
+			for (unsigned j = 0, k; j < order.size(); j = k) {
+				loc_t loc = batch[order[j]].loc;
+				for (k = j + 1; k < order.size() && batch[order[k]].loc == loc;)
+					k++;
+				u64 codes[4] = {};
+				for (unsigned m = j; m < k; m++) {
+					unsigned code = rb_hash(batch[order[m]].hash);
+					codes[code >> 6] |= power2(code & 63);
+				}
+				struct recinfo ri = {blocksize, reclen, blockdata(loc), loc, this};
+				struct resolve resolve = {
+					.entries = batch.data(), .from = &order[j], .to = &order[k],
+					.mask = keymask & (~bitmask(shift) | bitmask(tier.sigbits)), .keymask = keymask,
+					.width = width, .known = boundbits, .bound = bound, .loc = boundloc,
+					.hits = &hits };
+				recops.select(&ri, codes, match, &resolve);
+			}
+
+			std::stable_sort(hits.begin(), hits.end(), [](const struct hit &a, const struct hit &b) {
+				return a.entry < b.entry; });
+			for (unsigned j = 0; j < hits.size(); j++) {
+				if (!j || hits[j - 1].entry != hits[j].entry)
+					found++;
+				fn(context, hits[j].key, hits[j].keylen, hits[j].data, hits[j].reclen);
+			}
+			cursor = (struct cursor){cursor::active, tier.mapbits, tier.sigbits, boundmap, boundsig,
+				batch.back().pos, bound, batch.back().loc, boundloc};
+			batch.clear();
+		};
+
+		for (unsigned b = first; b < shard->buckets(); b++) {
+			if (!shard->bucket_used(b))
+				continue;
+			bucket.clear();
+			shard->walk_bucket([&bucket](hashkey_t key, loc_t loc) { bucket.push_back({key, loc}); }, b);
+			std::sort(bucket.begin(), bucket.end());
+
+			for (unsigned j = 0; j < bucket.size(); j++) {
+				hashkey_t key = bucket[j].first;
+				loc_t loc = bucket[j].second;
+				u64 pos = base | key << (64 - width);
+				if (j && bucket[j - 1] == bucket[j])
+					continue; // same hash in same block, resolved together
+				if (!fresh && (inclusive ? pos < start : pos < from || (pos == from && loc <= fromloc)))
+					continue;
+				if (found == max)
+					return found;
+				batch.push_back({(u64)ix << shift | key, loc, pos});
+				if (found + batch.size() == max)
+					flush();
+			}
+		}
+		if (batch.size())
+			flush();
+		i = (ix + 1) << tiershift(tier);
+	}
+
+	cursor.state = cursor::done;
+	return found;
+}
+
+/*
+ * Position a cursor so iteration resumes at the hash position of key, which
+ * gives a scan of some length from an arbitrary start, as in a range scan
+ */
+void keymap::seek(struct cursor &cursor, const void *key, unsigned len)
+{
+	unsigned width = upper->mapbits + sigbits;
+	hashkey_t hash = keyhash(key, len) & keymask;
+	cursor = (struct cursor){cursor::active, (u8)upper->mapbits, (u8)sigbits, 0, 0, hash << (64 - width), 0, 0, 0};
+}
+
+/* Shared nothing front end */
+
+/*
+ * Single producer single consumer ring. Each side caches the position of
+ * the other so it touches the shared line only when it appears full or
+ * empty, and the producer publishes a batch with one store.
+ */
+template <typename T> struct spscring
+{
+	enum {order = 10, size = 1 << order, mask = size - 1};
+	alignas(64) std::atomic<unsigned> head{0}; // consumed, written by consumer
+	unsigned seen_tail = 0; // consumer copy of tail
+	alignas(64) std::atomic<unsigned> tail{0}; // published, written by producer
+	unsigned next = 0, seen_head = 0; // producer unpublished position and copy of head
+	alignas(64) T slot[size];
+
+	unsigned room()
+	{
+		if (next - seen_head == size)
+			seen_head = head.load(std::memory_order_acquire);
+		return size - (next - seen_head);
+	}
+
+	bool push(const T &item)
+	{
+		if (!room())
+			return 0;
+		slot[next++ & mask] = item;
+		return 1;
+	}
+
+	void publish() { tail.store(next, std::memory_order_release); }
+
+	unsigned pop(T *out, unsigned max)
+	{
+		unsigned at = head.load(std::memory_order_relaxed);
+		if (seen_tail == at)
+			seen_tail = tail.load(std::memory_order_acquire);
+		unsigned n = std::min(max, seen_tail - at);
+		for (unsigned i = 0; i < n; i++)
+			out[i] = slot[(at + i) & mask];
+		head.store(at + n, std::memory_order_release);
+		return n;
+	}
+};
+
+/* Spin briefly when there is nothing to do, then give up the cpu */
+static void idle_wait(unsigned &idle)
+{
+	enum {spins = 256};
+	if (++idle < spins)
+		_mm_pause();
+	else
+		sched_yield();
+}
+
+struct coreclient
+{
+	alignas(64) std::vector<bool> dirty; // workers with unpublished requests from this client
+};
+
+struct coreworker
+{
+	enum {batch_max = 64};
+	struct coremap &core;
+	const unsigned index;
+	struct header header; // referenced by the keymap for its lifetime
+	int fd;
+	struct keymap *map = NULL;
+	std::vector<spscring<struct corereq> *> in; // from each client
+	std::vector<spscring<struct coredone> *> out; // to each client
+	std::atomic<bool> stop{0}, pause{0}, paused{0};
+	std::thread thread;
+
+	coreworker(struct coremap &core, unsigned index, int fd, const struct header &header) :
+		core(core), index(index), header(header), fd(fd)
+	{
+		for (unsigned i = 0; i < core.clients; i++) {
+			in.push_back(new spscring<struct corereq>);
+			out.push_back(new spscring<struct coredone>);
+		}
+		thread = std::thread([this]() { run(); });
+	}
+
+	~coreworker()
+	{
+		stop = 1;
+		thread.join();
+		for (unsigned i = 0; i < core.clients; i++) {
+			delete in[i];
+			delete out[i];
+		}
+		close(fd);
+	}
+
+	int execute(const struct corereq &req)
+	{
+		rec_t *rec;
+		switch (req.op) {
+		case corereq::insert:
+			rec = map->insert(req.key, req.len, req.data);
+			return is_errcode(rec) ? errcode(rec) : 0;
+		case corereq::remove:
+			return map->remove(req.key, req.len);
+		default:
+			if (!(rec = map->lookup(req.key, req.len)))
+				return -ENOENT;
+			if (req.op == corereq::update) {
+				memcpy(rec, req.data, core.reclen);
+				map->changed(rec, core.reclen);
+			} else if (req.data)
+				memcpy(req.data, rec, core.reclen);
+			return 0;
+		}
+	}
+
+	/*
+	 * Take no more requests from a client than its completion ring has
+	 * room for, so a client that submits without polling stalls only
+	 * itself. Each worker takes its own cpu from those the process may
+	 * run on, if there are enough. The table is created here so it is
+	 * local to that cpu.
+	 */
+	void run()
+	{
+		cpu_set_t set;
+		if (!sched_getaffinity(0, sizeof set, &set) && core.workers <= (unsigned)CPU_COUNT(&set)) {
+			unsigned cpu = 0;
+			for (unsigned seen = 0; cpu < CPU_SETSIZE; cpu++)
+				if (CPU_ISSET(cpu, &set) && seen++ == index)
+					break;
+			CPU_ZERO(&set);
+			CPU_SET(cpu, &set);
+			sched_setaffinity(0, sizeof set, &set);
+		}
+		map = new keymap(header, fd, fixsize::recops, core.reclen);
+		struct corereq batch[batch_max];
+
+		for (unsigned idle = 0; !stop;) {
+			if (pause) {
+				paused = 1;
+				while (pause)
+					sched_yield();
+				paused = 0;
+			}
+			unsigned work = 0;
+			for (unsigned i = 0; i < core.clients; i++) {
+				unsigned n = in[i]->pop(batch, std::min((unsigned)batch_max, out[i]->room()));
+				for (unsigned j = 0; j < n; j++)
+					out[i]->push({batch[j].tag, execute(batch[j])});
+				if (n)
+					out[i]->publish();
+				work += n;
+			}
+			if (work)
+				idle = 0;
+			else
+				idle_wait(idle);
+		}
+		delete map;
+	}
+};
+
+coremap::coremap(const char *path, unsigned workers, unsigned clients, const struct header &header, unsigned reclen) :
+	workers(workers), clients(clients), reclen(reclen), clientstate(new struct coreclient[clients])
+{
+	for (unsigned i = 0; i < clients; i++)
+		clientstate[i].dirty.resize(workers);
+	for (unsigned i = 0; i < workers; i++) {
+		const std::string name = std::string(path) + std::to_string(i);
+		int fd = open(name.c_str(), O_CREAT|O_RDWR|O_TRUNC, 0644);
+		if (fd < 0)
+			error_exit(1, "could not create %s (%s)", name.c_str(), strerror(errno));
+		cores.push_back(new struct coreworker(*this, i, fd, header));
+	}
+}
+
+coremap::~coremap()
+{
+	for (struct coreworker *core: cores)
+		delete core;
+	delete[] clientstate;
+}
+
+/*
+ * Worker by hash, remixed so each worker still sees hashes spread evenly
+ * over its own shard index space, whatever the worker count.
+ */
+unsigned coremap::owner(const void *key, unsigned len) const
+{
+	u64 mix = keyhash(key, len) * 0x9e3779b97f4a7c15ULL;
+	return ((mix >> 32) * workers) >> 32;
+}
+
+/* Queue a request, false if the ring to its worker is full */
+bool coremap::submit(unsigned client, const struct corereq &req)
+{
+	unsigned i = owner(req.key, req.len);
+	if (!cores[i]->in[client]->push(req))
+		return 0;
+	clientstate[client].dirty[i] = 1;
+	return 1;
+}
+
+/* Make queued requests visible to their workers */
+void coremap::flush(unsigned client)
+{
+	std::vector<bool> &dirty = clientstate[client].dirty;
+	for (unsigned i = 0; i < workers; i++) {
+		if (dirty[i]) {
+			cores[i]->in[client]->publish();
+			dirty[i] = 0;
+		}
+	}
+}
+
+/* Collect up to max completions from all workers, without waiting */
+unsigned coremap::poll(unsigned client, struct coredone *done, unsigned max)
+{
+	unsigned n = 0;
+	for (unsigned i = 0; i < workers && n < max; i++)
+		n += cores[i]->out[client]->pop(done + n, max - n);
+	return n;
+}
+
+/* One request and wait for it, only with nothing else in flight */
+int coremap::call(unsigned client, struct corereq req)
+{
+	struct coredone done;
+	while (!submit(client, req))
+		sched_yield();
+	flush(client);
+	for (unsigned idle = 0; !poll(client, &done, 1);)
+		idle_wait(idle);
+	return done.status;
+}
+
+int coremap::insert(unsigned client, const void *key, unsigned len, const void *data)
+{
+	if (len > maxname)
+		return -EINVAL;
+	return call(client, {corereq::insert, (u8)len, 0, key, (void *)data});
+}
+
+int coremap::lookup(unsigned client, const void *key, unsigned len, void *data)
+{
+	if (len > maxname)
+		return -EINVAL;
+	return call(client, {corereq::lookup, (u8)len, 0, key, data});
+}
+
+int coremap::remove(unsigned client, const void *key, unsigned len)
+{
+	if (len > maxname)
+		return -EINVAL;
+	return call(client, {corereq::remove, (u8)len, 0, key, NULL});
+}
+
+/*
+ * Run fn on every worker table with all workers parked, for stats and
+ * the like. Requests still in flight wait until the workers resume.
+ */
+void coremap::each(std::function<void(unsigned worker, struct keymap &map)> fn)
+{
+	for (struct coreworker *core: cores)
+		core->pause = 1;
+	for (struct coreworker *core: cores)
+		while (!core->paused)
+			sched_yield();
+	for (struct coreworker *core: cores)
+		fn(core->index, *core->map);
+	for (struct coreworker *core: cores)
+		core->pause = 0;
+	for (struct coreworker *core: cores)
+		while (core->paused)
+			sched_yield();
+}
+
 int test(int argc, const char *argv[])
 {
 	struct header head = {
@@ -1636,6 +4485,6 @@ int test(int argc, const char *argv[])
 	}
 
 	//printf("used %i blocks\n", sink.block + 1);
-	printf("tests %li probes %li blocks %u\n", tests, probes, sm.blocks);
+	printf("stats %s\n", sm.stats_json(1).c_str());
 	return 0;
 }
@@ -7,6 +7,8 @@
 #include <stdint.h>
 #include <functional> // to pass lambdas to bucket walkers
 #include <vector>
+#include <string>
+#include <atomic> // event counters
 
 typedef uint64_t u64;
 typedef uint32_t u32;
@@ -16,11 +18,12 @@ typedef uint8_t rec_t;
 typedef uint32_t loc_t;
 typedef unsigned fixed8;
 typedef int64_t s64;
+typedef int8_t s8;
 
 /* cache line and pmem characteristics */
 
 typedef uint64_t cell_t;
-enum {logorder = 9, logsize = 1 << logorder, logmask = logsize - 1};
+enum {logorder_default = 9, logorder_min = 4, logorder_max = 16, loglanes_max = 64};
 enum {cellshift = 3, cellsize = 1 << cellshift};
 enum {lineshift = 6, linesize = 1 << lineshift, linemask = linesize - 1, linecells = linesize >> cellshift};
 enum {blocklines = 4, blockcells = blocklines * linecells};
@@ -47,6 +50,7 @@ struct bigmap
 	uint8_t big;
 	uint16_t reclen; // this is only here because some ext_bigmap functions need it. Fix!!!
 	uint8_t *rbspace; // this is only here because we have not properly abstracted the block mapping yet!!!
+	uint64_t scanned; // map entries examined by bigmap_try, for stats
 };
 
 /* Exports */
@@ -88,7 +92,33 @@ enum {one_fixed8 = 0x100};
 typedef u32 count_t; // many places should use this instead of u32!!!
 typedef u64 hashkey_t;
 
-struct region { u64 /* is this right? */ size, align; void **mem; loff_t *pos; };
+struct region
+{
+	enum {hugepage = 1, random = 2, populate = 4}; // mapping policy
+	u64 /* is this right? */ size, align; void **mem; loff_t *pos; unsigned policy;
+};
+
+/* Shard table allocator, shared by all keymaps */
+
+struct tablestats { u64 mapped, hugetlb, advised, inuse, allocs, recycled; };
+extern struct tablestats tablestats;
+void *table_alloc(unsigned order, int node = -1);
+void table_free(void *table, unsigned order, int node = -1);
+
+/* NUMA placement */
+
+enum {numa_maxnodes = 64}; // node ids fit one mbind mask word
+unsigned numa_online(u8 *ids);
+int numa_bind(void *mem, u64 size, unsigned node);
+int numa_run_on(unsigned node);
+
+/* Background maintenance pool, shared by all keymaps */
+
+enum maint_kind {maint_cpu, maint_io, maint_kinds};
+struct maintstats { u64 tasks, stolen, helped, waited, ran[maint_kinds]; };
+int maint_setup(unsigned workers, unsigned cpu_budget = 0, unsigned io_budget = 0);
+void maint_shutdown();
+struct maintstats maint_stats();
 
 struct layout
 {
@@ -96,8 +126,11 @@ struct layout
 
 	std::vector<region> map;
 	loff_t size = 0;
+	void *base = NULL; // single map
 	void do_maps(int fd);
 	void redo_maps(int fd);
+	int share();
+	int sync();
 };
 
 struct header {
@@ -113,25 +146,69 @@ struct header {
 		u32 maploc;
 		bool is_empty() const { return !stridebits; }
 	}  __attribute__((packed)) upper, lower;
+	u8 logorder, loglanes; // microlog entries per lane as power of 2, lanes, zero for defaults
 } __attribute__((packed));
 
+/*
+ * First block of a map file, so a closed file can be opened again, for now
+ * read only by inspect. The owner rewrites it when geometry or block count
+ * changed. Region offsets are recorded rather than derived because regions
+ * stay put until the next relayout, not where a fresh layout would go.
+ */
+enum {super_version = 1, super_size = 4096};
+
+struct superblock
+{
+	char magic[8];
+	u32 version, reclen;
+	u64 size; // mapped bytes
+	u32 blocks, maxblocks;
+	u64 rbspace, countmap[2], shardmap[2]; // region offsets, upper tier first
+	struct header header;
+};
+
+/*
+ * One writer's run of the microlog ring. Each lane is a separate log with
+ * its own head and tail on its own cache line, so writers on different
+ * lanes do not contend for a tail or order their flushes behind each other.
+ */
+struct loglane
+{
+	unsigned head, tail;
+} __attribute__((aligned(64)));
+
+/* Count map cache line staged for write back by unify */
+
+struct countline
+{
+	count_t *to;
+	count_t data[linesize / sizeof(count_t)];
+};
+
 struct tier
 {
 	duopack duo; // defines loc:sigbits variable width media image entries
 	u8 mapbits, stridebits, locbits, sigbits, unused[3]; // sigbits not used in fast path, can derive from shardmap sigbits and difference between tier mapbits.
 	count_t *countbuf; // front buffer
 	count_t *countmap; // pmem, cannot be freed, please make it clear
+	u64 *countdirty; // one bit per countbuf cache line changed since unify
 	cell_t *shardmap;
 	loff_t countmap_pos; // not really used!
 	loff_t shardmap_pos; // not really used!
+	unsigned shadowed = 0; // spare stride cells holding flatten images until unify
 
 	tier(const struct header &header, const struct header::tierhead &tierhead);
 	tier() = default;unsigned shards() const;
 	bool is_empty() const;
 	void cleanup();
 	count_t *getbuf(unsigned size);
+	unsigned countsize() const;
+	void dirty(unsigned ix) const;
+	void stage_counts(std::vector<struct countline> &lines);
 	cell_t *at(unsigned ix, unsigned i) const;
 	void store(unsigned ix, unsigned i, cell_t entry) const;
+	cell_t *spare() const;
+	const cell_t *fifo(unsigned ix, unsigned count) const;
 } ;
 
 struct shard
@@ -142,8 +219,10 @@ struct shard
 	unsigned count; // measured in hash entries
 	const unsigned limit; // measured in hash entries
 	const u8 tablebits, lowbits;
+	const s8 node; // numa node of table, -1 for none
 	const u8 tx:1; // tier relative to current upper: 0 = upper, 1 = lower
 	u16 ix:15; // shard index within tier map
+	u16 hot:1; // referenced since the eviction clock hand last passed
 	struct shard_entry { u64 key_loc_link; } *table;
 	struct keymap *const map;
 	const tripack tri;
@@ -151,9 +230,10 @@ struct shard
 	bool is_lower();
 	const struct tier &tier() const;
 	rec_t *lookup(const void *name, unsigned len, hashkey_t key);
+	void candidates(hashkey_t key, std::vector<loc_t> &locs);
 	int insert(const hashkey_t key, const loc_t loc);
 	int remove(const hashkey_t key, const loc_t loc);
-	int remove(const void *name, unsigned len, hashkey_t key);
+	int remove(const void *name, unsigned len, hashkey_t key, loc_t only = -1);
 	unsigned buckets();
 	bool bucket_used(const unsigned i);
 	unsigned next_entry(const unsigned link);
@@ -162,6 +242,8 @@ struct shard
 	void empty();
 	count_t &mediacount() const;
 	unsigned buckets() const;
+	cell_t magic() const;
+	void stamp();
 	void imprint();
 	void walk_bucket(std::function<void(hashkey_t key, loc_t loc)> fn, unsigned bucket);
 	void walk_buckets(std::function<void(unsigned bucket)> fn);
@@ -169,16 +251,130 @@ struct shard
 	void dump(const unsigned flags = -1, const char *tag = "") __attribute__((used));
 	int load_from_media();
 	int flatten();
+	void rewrite();
+	unsigned image(cell_t *to);
+	bool is_bloated() const;
+	bool is_clean() const;
 	void reshard_part(struct shard *out, unsigned more_shards, unsigned part);
 protected: // disallow stack instance because of self destruct
 	~shard();
 	friend class keymap; // allow delete
 };
 
+/*
+ * Resume token for hash order iteration, opaque to callers, who may keep it
+ * indefinitely. Position is the full hash and block of the last entry
+ * returned, with the tier geometry that determined which hash bits were
+ * known, so the position can be mapped onto a different geometry after
+ * reshard or map growth. Bound is the position saved before the latest
+ * geometry change, below which records were already returned.
+ */
+struct cursor
+{
+	enum {fresh, active, done};
+	u8 state, mapbits, sigbits; // geometry of shard last visited
+	u8 boundmap, boundsig; // geometry of bound, none if zero
+	u64 pos, bound; // left justified full hash, unknown bits zero
+	loc_t loc, boundloc; // block of last entry returned, orders equal hashes
+};
+
 struct recinfo { const unsigned blocksize, reclen; u8 *data; loc_t loc; struct keymap *map;};
 
 typedef void (rb_walk_fn)(void *context, u8 *key, unsigned keylen, u8 *data, unsigned reclen);
 
+/* Scan predicate and aggregate, applied per record block without callbacks */
+
+struct scanspec
+{
+	enum {all, eq, ne, lt, le, gt, ge} where; // compare 8 byte signed field at where_at with value
+	unsigned where_at;
+	s64 value;
+	unsigned sum_at; // 8 byte signed field to aggregate
+};
+
+struct scansum
+{
+	u64 records, matched;
+	s64 sum, min, max;
+};
+
+struct flusher; // background unify, private to shardmap.cc
+struct blockpool; // record block cache, private to shardmap.cc
+
+struct poolstats { u64 frames, hits, misses, reads, writes; };
+
+/*
+ * Latency histograms in tsc cycles, for public ops and for the internal
+ * steps that can stall them. Log linear buckets as in hdr histogram: each
+ * power of two is split into subbuckets, so precision is about 6% at any
+ * magnitude. Each histogram has a single writer, the keymap owner thread
+ * or for unify_batch whoever runs the flusher task.
+ */
+enum timed_event {
+	time_lookup, time_insert, time_remove, time_scan, // public ops
+	time_create, time_bigmap_try, time_unify_begin, time_unify_wait, time_unify_batch,
+	time_rehash, time_reshard, time_grow_map, time_add_tier, time_redo_maps,
+	time_populate, time_evict, time_compact, time_flatten,
+	timed_events};
+
+extern const char *timed_event_name[timed_events];
+
+struct histogram
+{
+	enum {subbits = 4, subbuckets = 1 << subbits, buckets = (64 - subbits + 1) * subbuckets};
+	u64 samples, total, max, count[buckets];
+	void add(u64 cycles);
+	u64 percentile(double fraction) const;
+	static unsigned bucket(u64 cycles);
+	static u64 lower(unsigned bucket);
+};
+
+struct timing
+{
+	double cycles_per_ns;
+	struct histogram event[timed_events];
+};
+
+/*
+ * Event counters, always on. Each thread bumps a cache line slot of the
+ * keymap chosen by thread index and a reader sums the slots. Counters are
+ * relaxed atomics because threads beyond the slot count share slots and a
+ * reader runs concurrently, but the adds stay uncontended in the usual case.
+ */
+enum stat_counter {
+	stat_lookups, stat_hits, stat_misses, stat_inserts, stat_removes,
+	stat_buckets, stat_chain, stat_probes, stat_tag_false, // per shard bucket walk
+	stat_unifies, stat_unify_bytes, stat_stalls,
+	stat_rehash, stat_reshard, stat_grow_map, stat_add_tier, stat_drop_tier,
+	stat_populate, stat_evict, stat_flatten, stat_compact, stat_merge,
+	stat_bigmap_try, stat_bigmap_scan,
+	stat_counters};
+
+extern const char *stat_counter_name[stat_counters];
+
+struct statslot { alignas(64) std::atomic<u64> counter[stat_counters]; };
+
+/* File survey by keymap::inspect, media fifos and counts by tier upper first */
+struct inspection
+{
+	enum {fifo_bins = 32, chain_bins = 16, fill_bins = 10};
+	struct fifos { u64 shards, entries, tombstones, longest, log2[fifo_bins]; } fifos[2];
+	std::vector<u32> entries[2], tombstones[2]; // by shard
+	u64 buckets, chain[chain_bins]; // populated buckets by chain length, last bin open ended
+	u64 blocks, maps, bad, records, holes, hole_bytes, gap_bytes, fill[fill_bins]; // record blocks by tenths
+	u64 slack; // bigmap free space hints above actual, from bigmap_check
+	void add(const struct inspection &more);
+};
+
+struct keystats
+{
+	enum {fill_bins = 10};
+	u64 counter[stat_counters];
+	u64 shards, resident, entries, fill[fill_bins]; // resident shards by tenths of limit
+	u64 blocks, hole_bytes; // record blocks, only if walked
+	bool walked;
+};
+
 // recops.h inlined here...
 
 /* record block format */
@@ -213,6 +409,10 @@ struct recops {
 	rec_t *(*create)(struct recinfo *ri, const void *newkey, u8 newlen, u16 lowhash, const void *newrec, u8 varlen);
 	int (*remove)(struct recinfo *ri, const void *key, u8 len, u16 lowhash);
 	int (*walk)(struct recinfo *ri, rb_walk_fn fn, void *context);
+	int (*select)(struct recinfo *ri, const u64 *codes, rb_walk_fn fn, void *context);
+	int (*scan)(struct recinfo *ri, const struct scanspec *spec, struct scansum *sum);
+	int (*waste)(struct recinfo *ri);
+	int (*compact)(struct recinfo *ri);
 };
 
 namespace fixsize {
@@ -231,6 +431,10 @@ namespace fixsize {
 	rec_t *rb_create(struct recinfo *ri, const void *newkey, u8 newlen, u16 lowhash, const void *newrec, u8 varlen = 0);
 	int rb_remove(struct recinfo *ri, const void *key, u8 len, u16 lowhash);
 	int rb_walk(struct recinfo *ri, rb_walk_fn fn, void *context);
+	int rb_select(struct recinfo *ri, const u64 *codes, rb_walk_fn fn, void *context);
+	int rb_scan(struct recinfo *ri, const struct scanspec *spec, struct scansum *sum);
+	int rb_waste(struct recinfo *ri);
+	int rb_compact(struct recinfo *ri);
 	extern struct recops recops;
 }
 
@@ -259,13 +463,33 @@ struct keymap : bigmap
 	loff_t microlog_pos;
 	loff_t rbspace_pos;
 
-	unsigned loghead = 0, logtail = 0;
+	unsigned logorder, logsize, logmask, logbatch, loglanes; // per lane ring geometry
+	struct loglane *lanes = NULL;
+	unsigned churn = 0; // removes since last compaction pass
+	loc_t compact_at = 0; // next block for compaction to examine
+	u64 cachebytes = 0, cachebudget = -1; // shard cache footprint and limit
+	unsigned clock_at = 0; // eviction clock hand
+	unsigned nodes = 1; // numa nodes owning contiguous shard index ranges
+	u8 nodeid[numa_maxnodes] = {}; // numa node id of each shard index range
+	struct flusher *flusher = NULL; // unifies a sealed log half in the background
+	loc_t flushing = -1; // sink block of the batch in flight, readers wait for it
+	struct blockpool *pool = NULL; // record blocks by explicit io instead of file map
+	struct timing *timing = NULL; // latency histograms if enabled
+	struct statslot *statslots = NULL; // event counters by thread
+	struct superblock *super = NULL; // mapped first block of file
+	bool readonly = 0; // opened by superblock for inspection
+
+	enum {statslots_max = 16};
 
 	struct layout layout;
 
 	enum {reclen_default = 100};
+	enum {background_unify = 1};
 
 	keymap(struct header &header, const int fd, struct recops &recops, unsigned reclen = reclen_default);
+	keymap(struct superblock &super, const int fd, struct recops &recops);
+	static int read_super(int fd, struct superblock &super);
+	void write_super();
 
 	struct shard *new_shard(const struct tier *tier, unsigned i, unsigned tablebits, bool virgin = 1);
 	struct shard **mapalloc();
@@ -277,15 +501,27 @@ struct keymap : bigmap
 	void spam(struct shard *shard_or_null, unsigned ix, unsigned shift);
 	void dump(unsigned flags = 1);
 	unsigned burst();
+	unsigned burst(const struct loglane &lane) const;
+	struct loglane &lane();
+	struct pmblock *lanelog(const struct loglane &lane) const;
+	struct sidelog *laneside(const struct loglane &lane) const;
+	u64 microlog_size() const;
 	const struct tier &tier(const struct shard *shard) const;
 	unsigned tiershift(const struct tier &tier) const;
 	bool single_tier() const;
 	struct shard *populate(unsigned i, bool for_insert = 0);
 	void populate_all();
 	struct shard *getshard(unsigned i, bool for_insert = 1);
+	unsigned evict(u64 target);
+	void keep_budget();
+	void set_cache_budget(u64 bytes);
+	void set_numa(unsigned nodes = 0);
+	void bind_media();
+	int shard_node(unsigned i) const;
+	unsigned key_node(const void *key, unsigned len) const;
 	struct shard *setshard(const unsigned i, struct shard *shard);
 	static u64 shardmap_size(struct tier *tier);
-	enum {map_rbspace = 0}; // rbspace layout map vector position for maxblocks
+	enum {map_rbspace = 1}; // rbspace layout map vector position for maxblocks
 	void define_layout(std::vector<region> &map);
 	int rehash(const unsigned i, const unsigned more);
 	int reshard(const unsigned i, const unsigned more_shards, const unsigned more_buckets);
@@ -301,7 +537,78 @@ struct keymap : bigmap
 	rec_t *insert(const char *name, unsigned namelen, const void *data, bool unique = 1);
 	rec_t *lookup(const void *name, unsigned len);
 	rec_t *lookup(const char *name, unsigned len);
+	typedef std::function<void(unsigned i, rec_t *rec)> multiget_fn;
+	void lookup_many(const void *const names[], const unsigned lens[], unsigned n, multiget_fn fn);
 	int remove(const void *name, unsigned len);
 	int remove(const char *name, unsigned len);
     int unify();
+	void unify_begin();
+	bool unify_wait();
+	void persist(const void *mem, u64 len);
+	void shadow_flatten(std::vector<struct shard *> &flat);
+	void shadow_images(bool counted);
+	void unify_batch(struct flusher &batch);
+	u8 *blockdata(loc_t loc);
+	int set_pool(unsigned blocks, bool direct = 0);
+	struct poolstats pool_stats();
+	void read_block(loc_t loc, u8 *buf);
+	void write_block(loc_t loc, u8 *buf);
+	void pin(const void *rec);
+	void unpin(const void *rec);
+	void changed(const void *mem, unsigned len);
+	void set_timing(bool enable);
+	const struct histogram *histogram(enum timed_event what) const;
+	void dump_timing();
+	void count(enum stat_counter what, u64 n = 1);
+	struct keystats stats(bool walk = 0);
+	std::string stats_json(bool walk = 0);
+	void inspect(struct inspection &out, unsigned threads);
+	void scan_range(const struct scanspec &spec, struct scansum &sum, loc_t start, loc_t end);
+	int scan(const struct scanspec &spec, struct scansum &sum, unsigned threads = 0);
+	int iterate(struct cursor &cursor, unsigned max, rb_walk_fn fn, void *context);
+	void seek(struct cursor &cursor, const void *key, unsigned len);
+	typedef std::function<bool(const void *&key, unsigned &keylen, const void *&data)> bulk_source;
+	static int bulk_geometry(struct header &header, u64 records, unsigned reclen, unsigned keylen);
+	u64 bulk_load(bulk_source next);
+	unsigned merge(loc_t loc, u8 *scratch);
+	unsigned compact(unsigned budget);
+};
+
+/*
+ * Shared nothing front end. Keys are dealt by hash to worker threads, each
+ * the only user of a keymap of its own, with its own file, shards, record
+ * sink, microlog and bigmap, so no table cache line moves between cores
+ * and resharding stays inside one partition. Each client reaches each
+ * worker by a pair of single producer single consumer rings, requests one
+ * way and completions the other, both published in batches.
+ */
+struct corereq
+{
+	enum {insert, lookup, update, remove} op;
+	u8 len; // key length, at most maxname
+	u32 tag; // returned with the completion
+	const void *key; // must stay valid until completion
+	void *data; // insert or update source, lookup destination if not null, reclen bytes
+};
+
+struct coredone { u32 tag; int status; }; // zero or negative errno
+
+struct coremap
+{
+	const unsigned workers, clients, reclen;
+	std::vector<struct coreworker *> cores;
+	struct coreclient *clientstate;
+
+	coremap(const char *path, unsigned workers, unsigned clients, const struct header &header,
+		unsigned reclen = keymap::reclen_default);
+	~coremap();
+	unsigned owner(const void *key, unsigned len) const;
+	bool submit(unsigned client, const struct corereq &req);
+	void flush(unsigned client);
+	unsigned poll(unsigned client, struct coredone *done, unsigned max);
+	int call(unsigned client, struct corereq req);
+	int insert(unsigned client, const void *key, unsigned len, const void *data);
+	int lookup(unsigned client, const void *key, unsigned len, void *data);
+	int remove(unsigned client, const void *key, unsigned len);
+	void each(std::function<void(unsigned worker, struct keymap &map)> fn);
 };
@@ -131,7 +131,7 @@ int tpcb_run(int fds[5], unsigned scalefactor, unsigned iterations)
 		/* Log redo record for replay in case of crash */
 		struct redo { id hid, aid, tid, bid; cash delta, a, b, t; };
 		struct redo redo = {hid, aid, tid, bid, delta, query.a->balance, query.b->balance, query.t->balance };
-		log_commit(xlog, &redo, sizeof redo, &retail);
+		log_commit(xlog, logorder_default, &redo, sizeof redo, &retail);
 
 		/* update balances in memory mapped records */
 		query.a->balance += delta;
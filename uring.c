@@ -0,0 +1,148 @@
+/*
+ * io_uring block I/O for the shardmap buffer pool
+ * License: GPL v3
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "debug.h"
+#include "uring.h"
+
+#define trace trace_off
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+/* Returns negative errno if io_uring is not available, caller falls back */
+int uring_open(struct uring *ring, unsigned entries)
+{
+	struct io_uring_params params = {};
+	memset(ring, 0, sizeof *ring);
+	int fd = io_uring_setup(entries, &params);
+	if (fd < 0)
+		return -errno;
+
+	ring->fd = fd;
+	ring->entries = params.sq_entries;
+	ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ring = mmap(NULL, ring->sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	ring->cq_ring = mmap(NULL, ring->cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		int err = -errno;
+		uring_close(ring);
+		return err;
+	}
+
+	void *sq = ring->sq_ring, *cq = ring->cq_ring;
+	ring->sq_head = sq + params.sq_off.head;
+	ring->sq_tail = sq + params.sq_off.tail;
+	ring->sq_mask = sq + params.sq_off.ring_mask;
+	ring->sq_array = sq + params.sq_off.array;
+	ring->cq_head = cq + params.cq_off.head;
+	ring->cq_tail = cq + params.cq_off.tail;
+	ring->cq_mask = cq + params.cq_off.ring_mask;
+	ring->cqes = cq + params.cq_off.cqes;
+	trace("io_uring fd %i, %u entries", fd, ring->entries);
+	return 0;
+}
+
+void uring_close(struct uring *ring)
+{
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_size);
+	if (ring->cq_ring && ring->cq_ring != MAP_FAILED)
+		munmap(ring->cq_ring, ring->cq_size);
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->fd > 0)
+		close(ring->fd);
+	memset(ring, 0, sizeof *ring);
+}
+
+/*
+ * Queue one entry. The expected transfer length goes in user_data so
+ * completion can tell a short transfer from success.
+ */
+static int uring_queue(struct uring *ring, int op, int fd, const void *buf, unsigned len, uint64_t pos, unsigned flags)
+{
+	if (ring->queued == ring->entries)
+		return -EBUSY;
+	unsigned tail = *ring->sq_tail, i = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = ring->sqes + i;
+	memset(sqe, 0, sizeof *sqe);
+	sqe->opcode = op;
+	sqe->flags = flags;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = pos;
+	sqe->user_data = len;
+	if (op == IORING_OP_FSYNC)
+		sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+	ring->sq_array[i] = i;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->queued++;
+	return 0;
+}
+
+int uring_read(struct uring *ring, int fd, void *buf, unsigned len, uint64_t pos)
+{
+	return uring_queue(ring, IORING_OP_READ, fd, buf, len, pos, 0);
+}
+
+int uring_write(struct uring *ring, int fd, const void *buf, unsigned len, uint64_t pos)
+{
+	return uring_queue(ring, IORING_OP_WRITE, fd, buf, len, pos, 0);
+}
+
+/* Barrier: drains everything queued before it, then syncs file data */
+int uring_fsync(struct uring *ring, int fd)
+{
+	return uring_queue(ring, IORING_OP_FSYNC, fd, NULL, 0, 0, IOSQE_IO_DRAIN);
+}
+
+/* Submit everything queued, wait for all of it, return the first error */
+int uring_run(struct uring *ring)
+{
+	unsigned submit = ring->queued, done = 0;
+	int err = 0;
+
+	while (done < ring->queued) {
+		int ret = io_uring_enter(ring->fd, submit, ring->queued - done, IORING_ENTER_GETEVENTS);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			err = -errno;
+			break;
+		}
+		submit -= ret < submit ? ret : submit;
+		unsigned head = *ring->cq_head;
+		while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = ring->cqes + (head & *ring->cq_mask);
+			if (!err && cqe->res != (int)cqe->user_data)
+				err = cqe->res < 0 ? cqe->res : -EIO;
+			head++;
+			done++;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+	ring->queued = 0;
+	return err;
+}
@@ -0,0 +1,24 @@
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring engine on raw syscalls, so no liburing needed. One ring
+ * per thread, never shared. Queue reads, writes and fsyncs, then run the
+ * lot with one submit and wait for all of them to complete.
+ */
+struct uring {
+	int fd;
+	unsigned entries, queued;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_size, cq_size, sqes_size;
+};
+
+int uring_open(struct uring *ring, unsigned entries);
+void uring_close(struct uring *ring);
+int uring_read(struct uring *ring, int fd, void *buf, unsigned len, uint64_t pos);
+int uring_write(struct uring *ring, int fd, const void *buf, unsigned len, uint64_t pos);
+int uring_fsync(struct uring *ring, int fd);
+int uring_run(struct uring *ring);